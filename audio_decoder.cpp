@@ -0,0 +1,345 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "audio_decoder.h"
+#include "audio_tooling.h"
+
+#include <cstring>
+#include <memory>
+#include <string>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+}
+
+#define AVIO_BUFFER_SIZE (64 * 1024)
+
+
+size_t MemoryAudioSource::read(uint8_t *output, size_t size) {
+    size_t available = length - position;
+    size_t n = size < available ? size : available;
+    memcpy(output, data + position, n);
+    position += n;
+    return n;
+}
+
+bool MemoryAudioSource::seek(int64_t offset) {
+    if (offset < 0 || (size_t) offset > length) {
+        return false;
+    }
+    position = (size_t) offset;
+    return true;
+}
+
+bool StreamingAudioSource::append(const char *data, size_t length) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (aborted) {
+        return false;
+    }
+    buffer.append(data, length);
+    cv.notify_all();
+    return true;
+}
+
+void StreamingAudioSource::close() {
+    std::unique_lock<std::mutex> lock(mutex);
+    closed = true;
+    cv.notify_all();
+}
+
+void StreamingAudioSource::abort() {
+    std::unique_lock<std::mutex> lock(mutex);
+    aborted = true;
+    cv.notify_all();
+}
+
+size_t StreamingAudioSource::read(uint8_t *output, size_t size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]() { return aborted || closed || position < buffer.size(); });
+    if (aborted) {
+        return 0;
+    }
+
+    size_t available = buffer.size() - position;
+    size_t n = size < available ? size : available;
+    memcpy(output, buffer.data() + position, n);
+    position += n;
+    return n;
+}
+
+bool StreamingAudioSource::seek(int64_t offset) {
+    if (offset < 0) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]() { return aborted || closed || (size_t) offset <= buffer.size(); });
+    if (aborted || (size_t) offset > buffer.size()) {
+        return false;
+    }
+    position = (size_t) offset;
+    return true;
+}
+
+int64_t StreamingAudioSource::tell() const {
+    std::unique_lock<std::mutex> lock(mutex);
+    return (int64_t) position;
+}
+
+int64_t StreamingAudioSource::size() const {
+    std::unique_lock<std::mutex> lock(mutex);
+    return closed ? (int64_t) buffer.size() : -1;
+}
+
+namespace {
+
+    std::string avErrorString(int errnum) {
+        char buf[AV_ERROR_MAX_STRING_SIZE] = {0};
+        av_strerror(errnum, buf, sizeof(buf));
+        return {buf};
+    }
+
+    int readPacket(void *opaque, uint8_t *buf, int buf_size) {
+        auto *source = static_cast<AudioSource *>(opaque);
+        size_t n = source->read(buf, (size_t) buf_size);
+        return n == 0 ? AVERROR_EOF : (int) n;
+    }
+
+    int64_t seekPacket(void *opaque, int64_t offset, int whence) {
+        auto *source = static_cast<AudioSource *>(opaque);
+        const int64_t size = source->size();
+
+        int64_t target;
+        switch (whence & ~AVSEEK_FORCE) {
+            case AVSEEK_SIZE:
+                return size >= 0 ? size : AVERROR(ENOSYS);
+            case SEEK_SET:
+                target = offset;
+                break;
+            case SEEK_CUR:
+                target = source->tell() + offset;
+                break;
+            case SEEK_END:
+                if (size < 0) {
+                    return AVERROR(ENOSYS);
+                }
+                target = size + offset;
+                break;
+            default:
+                return AVERROR(EINVAL);
+        }
+
+        return source->seek(target) ? target : AVERROR(EIO);
+    }
+
+    struct AVIOContextDeleter {
+        void operator()(AVIOContext *avio) const {
+            av_freep(&avio->buffer);
+            avio_context_free(&avio);
+        }
+    };
+
+    struct AVFormatContextDeleter {
+        void operator()(AVFormatContext *format) const { avformat_close_input(&format); }
+    };
+
+    struct AVCodecContextDeleter {
+        void operator()(AVCodecContext *codec) const { avcodec_free_context(&codec); }
+    };
+
+    struct SwrContextDeleter {
+        void operator()(SwrContext *swr) const { swr_free(&swr); }
+    };
+
+    struct AVFrameDeleter {
+        void operator()(AVFrame *frame) const { av_frame_free(&frame); }
+    };
+
+    struct AVPacketDeleter {
+        void operator()(AVPacket *packet) const { av_packet_free(&packet); }
+    };
+
+}
+
+void AudioDecoder::decode(AudioSource &source, std::vector<float> &pcmf32,
+                          std::vector<std::vector<float>> &pcmf32s, bool stereo) {
+
+    // equivalent of the old "ffmpeg -loglevel panic"
+    static const bool quiet = (av_log_set_level(AV_LOG_PANIC), true);
+    (void) quiet;
+
+    auto *avioBuffer = static_cast<unsigned char *>(av_malloc(AVIO_BUFFER_SIZE));
+    if (avioBuffer == nullptr) {
+        throw ResamplingException("could not allocate decoder input buffer");
+    }
+
+    std::unique_ptr<AVIOContext, AVIOContextDeleter> avio(
+            avio_alloc_context(avioBuffer, AVIO_BUFFER_SIZE, 0, &source, readPacket, nullptr, seekPacket));
+    if (!avio) {
+        av_free(avioBuffer);
+        throw ResamplingException("could not allocate decoder input context");
+    }
+
+    AVFormatContext *rawFormat = avformat_alloc_context();
+    if (rawFormat == nullptr) {
+        throw ResamplingException("could not allocate demuxer context");
+    }
+    rawFormat->pb = avio.get();
+
+    // avformat_open_input frees the context on failure
+    int result = avformat_open_input(&rawFormat, nullptr, nullptr, nullptr);
+    if (result < 0) {
+        throw ResamplingException("could not open input : " + avErrorString(result));
+    }
+    std::unique_ptr<AVFormatContext, AVFormatContextDeleter> format(rawFormat);
+
+    result = avformat_find_stream_info(format.get(), nullptr);
+    if (result < 0) {
+        throw ResamplingException("could not read stream info : " + avErrorString(result));
+    }
+
+    const int streamIndex = av_find_best_stream(format.get(), AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    if (streamIndex < 0) {
+        throw ResamplingException("input has no audio stream");
+    }
+    AVStream *stream = format->streams[streamIndex];
+
+    const AVCodec *decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (decoder == nullptr) {
+        throw ResamplingException("no decoder for codec " + std::string(avcodec_get_name(stream->codecpar->codec_id)));
+    }
+
+    std::unique_ptr<AVCodecContext, AVCodecContextDeleter> codec(avcodec_alloc_context3(decoder));
+    if (!codec) {
+        throw ResamplingException("could not allocate decoder context");
+    }
+
+    result = avcodec_parameters_to_context(codec.get(), stream->codecpar);
+    if (result < 0) {
+        throw ResamplingException("could not configure decoder : " + avErrorString(result));
+    }
+
+    result = avcodec_open2(codec.get(), decoder, nullptr);
+    if (result < 0) {
+        throw ResamplingException("could not open decoder : " + avErrorString(result));
+    }
+
+    // only two channels can be told apart, any other input is decoded to mono without them
+    stereo = stereo && codec->channels == 2;
+
+    const int64_t inputLayout = codec->channel_layout != 0
+                                ? (int64_t) codec->channel_layout
+                                : av_get_default_channel_layout(codec->channels);
+    const int outputChannels = stereo ? 2 : 1;
+    const int64_t outputLayout = stereo ? AV_CH_LAYOUT_STEREO : AV_CH_LAYOUT_MONO;
+
+    std::unique_ptr<SwrContext, SwrContextDeleter> swr(
+            swr_alloc_set_opts(nullptr,
+                               outputLayout, AV_SAMPLE_FMT_FLT, COMMON_SAMPLE_RATE,
+                               inputLayout, codec->sample_fmt, codec->sample_rate,
+                               0, nullptr));
+    if (!swr || swr_init(swr.get()) < 0) {
+        throw ResamplingException("could not initialize resampler");
+    }
+
+    pcmf32.clear();
+    if (stereo) {
+        pcmf32s.assign(2, {});
+    }
+
+    if (format->duration > 0) {
+        const auto expected = (size_t) (format->duration * COMMON_SAMPLE_RATE / AV_TIME_BASE);
+        pcmf32.reserve(expected + COMMON_SAMPLE_RATE);
+        for (auto &channel: pcmf32s) {
+            channel.reserve(expected + COMMON_SAMPLE_RATE);
+        }
+    }
+
+    std::vector<float> converted;
+
+    // passing a null frame drains the samples still buffered in the resampler
+    auto convert = [&](const AVFrame *frame) {
+        const int inSamples = frame ? frame->nb_samples : 0;
+        const int outCapacity = swr_get_out_samples(swr.get(), inSamples);
+        if (outCapacity <= 0) {
+            return;
+        }
+        converted.resize((size_t) outCapacity * outputChannels);
+
+        auto *out = reinterpret_cast<uint8_t *>(converted.data());
+        const int outSamples = swr_convert(swr.get(), &out, outCapacity,
+                                           frame ? (const uint8_t **) frame->extended_data : nullptr,
+                                           inSamples);
+        if (outSamples < 0) {
+            throw ResamplingException("resampling failed : " + avErrorString(outSamples));
+        }
+
+        if (!stereo) {
+            pcmf32.insert(pcmf32.end(), converted.begin(), converted.begin() + outSamples);
+            return;
+        }
+
+        for (int i = 0; i < outSamples; i++) {
+            const float left = converted[2 * i];
+            const float right = converted[2 * i + 1];
+            pcmf32.push_back((left + right) * 0.5f);
+            pcmf32s[0].push_back(left);
+            pcmf32s[1].push_back(right);
+        }
+    };
+
+    std::unique_ptr<AVFrame, AVFrameDeleter> frame(av_frame_alloc());
+    std::unique_ptr<AVPacket, AVPacketDeleter> packet(av_packet_alloc());
+    if (!frame || !packet) {
+        throw ResamplingException("could not allocate decoder frame");
+    }
+
+    auto receiveFrames = [&]() {
+        while (true) {
+            int received = avcodec_receive_frame(codec.get(), frame.get());
+            if (received == AVERROR(EAGAIN) || received == AVERROR_EOF) {
+                return;
+            }
+            if (received < 0) {
+                throw ResamplingException("decoding failed : " + avErrorString(received));
+            }
+            convert(frame.get());
+            av_frame_unref(frame.get());
+        }
+    };
+
+    while ((result = av_read_frame(format.get(), packet.get())) >= 0) {
+        if (packet->stream_index == streamIndex) {
+            int sent = avcodec_send_packet(codec.get(), packet.get());
+            // a full decoder takes the packet once its pending frames are drained
+            while (sent == AVERROR(EAGAIN)) {
+                receiveFrames();
+                sent = avcodec_send_packet(codec.get(), packet.get());
+            }
+            // corrupt packets are skipped, the same way the ffmpeg cli carries on past them
+            if (sent < 0 && sent != AVERROR_INVALIDDATA) {
+                av_packet_unref(packet.get());
+                throw ResamplingException("decoding failed : " + avErrorString(sent));
+            }
+            receiveFrames();
+        }
+        av_packet_unref(packet.get());
+    }
+
+    if (result != AVERROR_EOF) {
+        throw ResamplingException("reading input failed : " + avErrorString(result));
+    }
+
+    // flush the decoder, then the resampler
+    avcodec_send_packet(codec.get(), nullptr);
+    receiveFrames();
+    convert(nullptr);
+
+    if (pcmf32.empty()) {
+        throw ResamplingException("input contains no audio samples");
+    }
+}
@@ -0,0 +1,96 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_AUDIO_DECODER_H
+#define TRANSCRIBER_AUDIO_DECODER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// Byte source the decoder pulls the encoded container from
+class AudioSource {
+public:
+    virtual ~AudioSource() = default;
+
+    // Copies up to size bytes into output, returns 0 once the source is exhausted
+    virtual size_t read(uint8_t *output, size_t size) = 0;
+
+    // Moves the read position to an absolute offset, returns false if it is out of range
+    virtual bool seek(int64_t offset) = 0;
+
+    [[nodiscard]] virtual int64_t tell() const = 0;
+
+    // Total length in bytes, or -1 while it is not known
+    [[nodiscard]] virtual int64_t size() const = 0;
+};
+
+class MemoryAudioSource : public AudioSource {
+public:
+    MemoryAudioSource(const char *data, size_t length) : data(data), length(length) {}
+
+    size_t read(uint8_t *output, size_t size) override;
+
+    bool seek(int64_t offset) override;
+
+    [[nodiscard]] int64_t tell() const override { return (int64_t) position; }
+
+    [[nodiscard]] int64_t size() const override { return (int64_t) length; }
+
+private:
+    const char *data;
+    size_t length;
+    size_t position = 0;
+};
+
+// Source fed incrementally while an upload is still arriving. Reads and seeks past the bytes
+// received so far block until more data is appended or the input is closed.
+class StreamingAudioSource : public AudioSource {
+public:
+    explicit StreamingAudioSource(size_t expectedLength = 0) { buffer.reserve(expectedLength); }
+
+    // Returns false once the reader has aborted and no longer wants data
+    bool append(const char *data, size_t length);
+
+    // Marks the end of the input
+    void close();
+
+    // Wakes a blocked reader and makes every further read return end of input
+    void abort();
+
+    size_t read(uint8_t *output, size_t size) override;
+
+    bool seek(int64_t offset) override;
+
+    [[nodiscard]] int64_t tell() const override;
+
+    [[nodiscard]] int64_t size() const override;
+
+private:
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::string buffer;
+    size_t position = 0;
+    bool closed = false;
+    bool aborted = false;
+};
+
+
+class AudioDecoder {
+
+public:
+    // Decodes anything libavformat/libavcodec understand into COMMON_SAMPLE_RATE float PCM.
+    // pcmf32 receives the mono downmix, pcmf32s the left/right channels when stereo is set and the
+    // input has two channels.
+    static void decode(AudioSource &source, std::vector<float> &pcmf32,
+                       std::vector<std::vector<float>> &pcmf32s, bool stereo);
+
+};
+
+
+#endif //TRANSCRIBER_AUDIO_DECODER_H
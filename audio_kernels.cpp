@@ -0,0 +1,316 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "audio_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AUDIO_KERNELS_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#define AUDIO_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+#include <cmath>
+
+#define PCM16_SCALE (1.0f / 32768.0f)
+#define PCM16_DOWNMIX_SCALE (1.0f / 65536.0f)
+
+
+namespace {
+
+    void monoToFloatScalar(const int16_t *pcm16, float *out, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = float(pcm16[i]) * PCM16_SCALE;
+        }
+    }
+
+    void stereoToFloatScalar(const int16_t *pcm16, float *mono, float *left, float *right, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            mono[i] = float(pcm16[2 * i] + pcm16[2 * i + 1]) * PCM16_DOWNMIX_SCALE;
+        }
+        if (left == nullptr || right == nullptr) {
+            return;
+        }
+        for (size_t i = 0; i < n; i++) {
+            left[i] = float(pcm16[2 * i]) * PCM16_SCALE;
+            right[i] = float(pcm16[2 * i + 1]) * PCM16_SCALE;
+        }
+    }
+
+    float dotScalar(const float *a, const float *b, size_t n) {
+        float sum = 0.0f;
+        for (size_t i = 0; i < n; i++) {
+            sum += a[i] * b[i];
+        }
+        return sum;
+    }
+
+    float absSumScalar(const float *x, size_t n) {
+        float sum = 0.0f;
+        for (size_t i = 0; i < n; i++) {
+            sum += std::fabs(x[i]);
+        }
+        return sum;
+    }
+
+#ifdef AUDIO_KERNELS_X86
+
+    __attribute__((target("avx2")))
+    void monoToFloatAvx2(const int16_t *pcm16, float *out, size_t n) {
+        const __m256 scale = _mm256_set1_ps(PCM16_SCALE);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i wide = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pcm16 + i)));
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(wide), scale));
+        }
+        monoToFloatScalar(pcm16 + i, out + i, n - i);
+    }
+
+    // Each 32-bit lane holds one L/R frame: madd with ones gives L + R, the arithmetic shifts
+    // sign-extend the low (left) and high (right) halves.
+    __attribute__((target("avx2")))
+    void stereoToFloatAvx2(const int16_t *pcm16, float *mono, float *left, float *right, size_t n) {
+        const __m256 scale = _mm256_set1_ps(PCM16_SCALE);
+        const __m256 downmixScale = _mm256_set1_ps(PCM16_DOWNMIX_SCALE);
+        const __m256i ones = _mm256_set1_epi16(1);
+        const bool split = left != nullptr && right != nullptr;
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i frames = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pcm16 + 2 * i));
+            __m256i sum = _mm256_madd_epi16(frames, ones);
+            _mm256_storeu_ps(mono + i, _mm256_mul_ps(_mm256_cvtepi32_ps(sum), downmixScale));
+            if (split) {
+                __m256i l = _mm256_srai_epi32(_mm256_slli_epi32(frames, 16), 16);
+                __m256i r = _mm256_srai_epi32(frames, 16);
+                _mm256_storeu_ps(left + i, _mm256_mul_ps(_mm256_cvtepi32_ps(l), scale));
+                _mm256_storeu_ps(right + i, _mm256_mul_ps(_mm256_cvtepi32_ps(r), scale));
+            }
+        }
+        stereoToFloatScalar(pcm16 + 2 * i, mono + i, split ? left + i : nullptr, split ? right + i : nullptr, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    float dotAvx2(const float *a, const float *b, size_t n) {
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+            acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+        }
+        for (; i + 8 <= n; i += 8) {
+            acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        }
+        __m256 acc = _mm256_add_ps(acc0, acc1);
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum) + dotScalar(a + i, b + i, n - i);
+    }
+
+    // clearing the sign bit is |x|
+    __attribute__((target("avx2")))
+    float absSumAvx2(const float *x, size_t n) {
+        const __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            acc0 = _mm256_add_ps(acc0, _mm256_and_ps(_mm256_loadu_ps(x + i), mask));
+            acc1 = _mm256_add_ps(acc1, _mm256_and_ps(_mm256_loadu_ps(x + i + 8), mask));
+        }
+        __m256 acc = _mm256_add_ps(acc0, acc1);
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum) + absSumScalar(x + i, n - i);
+    }
+
+    __attribute__((target("sse4.1")))
+    void monoToFloatSse41(const int16_t *pcm16, float *out, size_t n) {
+        const __m128 scale = _mm_set1_ps(PCM16_SCALE);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pcm16 + i));
+            __m128i lo = _mm_cvtepi16_epi32(samples);
+            __m128i hi = _mm_cvtepi16_epi32(_mm_srli_si128(samples, 8));
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+            _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+        }
+        monoToFloatScalar(pcm16 + i, out + i, n - i);
+    }
+
+    __attribute__((target("sse4.1")))
+    void stereoToFloatSse41(const int16_t *pcm16, float *mono, float *left, float *right, size_t n) {
+        const __m128 scale = _mm_set1_ps(PCM16_SCALE);
+        const __m128 downmixScale = _mm_set1_ps(PCM16_DOWNMIX_SCALE);
+        const __m128i ones = _mm_set1_epi16(1);
+        const bool split = left != nullptr && right != nullptr;
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m128i frames = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pcm16 + 2 * i));
+            __m128i sum = _mm_madd_epi16(frames, ones);
+            _mm_storeu_ps(mono + i, _mm_mul_ps(_mm_cvtepi32_ps(sum), downmixScale));
+            if (split) {
+                __m128i l = _mm_srai_epi32(_mm_slli_epi32(frames, 16), 16);
+                __m128i r = _mm_srai_epi32(frames, 16);
+                _mm_storeu_ps(left + i, _mm_mul_ps(_mm_cvtepi32_ps(l), scale));
+                _mm_storeu_ps(right + i, _mm_mul_ps(_mm_cvtepi32_ps(r), scale));
+            }
+        }
+        stereoToFloatScalar(pcm16 + 2 * i, mono + i, split ? left + i : nullptr, split ? right + i : nullptr, n - i);
+    }
+
+    __attribute__((target("sse4.1")))
+    float dotSse41(const float *a, const float *b, size_t n) {
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+        }
+        __m128 sum = _mm_add_ps(acc0, acc1);
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum) + dotScalar(a + i, b + i, n - i);
+    }
+
+    __attribute__((target("sse4.1")))
+    float absSumSse41(const float *x, size_t n) {
+        const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            acc0 = _mm_add_ps(acc0, _mm_and_ps(_mm_loadu_ps(x + i), mask));
+            acc1 = _mm_add_ps(acc1, _mm_and_ps(_mm_loadu_ps(x + i + 4), mask));
+        }
+        __m128 sum = _mm_add_ps(acc0, acc1);
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum) + absSumScalar(x + i, n - i);
+    }
+
+#endif
+
+#ifdef AUDIO_KERNELS_NEON
+
+    void monoToFloatNeon(const int16_t *pcm16, float *out, size_t n) {
+        const float32x4_t scale = vdupq_n_f32(PCM16_SCALE);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            int16x8_t samples = vld1q_s16(pcm16 + i);
+            vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(samples))), scale));
+            vst1q_f32(out + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(samples))), scale));
+        }
+        monoToFloatScalar(pcm16 + i, out + i, n - i);
+    }
+
+    void stereoToFloatNeon(const int16_t *pcm16, float *mono, float *left, float *right, size_t n) {
+        const float32x4_t scale = vdupq_n_f32(PCM16_SCALE);
+        const float32x4_t downmixScale = vdupq_n_f32(PCM16_DOWNMIX_SCALE);
+        const bool split = left != nullptr && right != nullptr;
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            // vld2 deinterleaves 8 frames into separate left and right registers
+            int16x8x2_t frames = vld2q_s16(pcm16 + 2 * i);
+            int16x4_t lLo = vget_low_s16(frames.val[0]);
+            int16x4_t lHi = vget_high_s16(frames.val[0]);
+            int16x4_t rLo = vget_low_s16(frames.val[1]);
+            int16x4_t rHi = vget_high_s16(frames.val[1]);
+            vst1q_f32(mono + i, vmulq_f32(vcvtq_f32_s32(vaddl_s16(lLo, rLo)), downmixScale));
+            vst1q_f32(mono + i + 4, vmulq_f32(vcvtq_f32_s32(vaddl_s16(lHi, rHi)), downmixScale));
+            if (split) {
+                vst1q_f32(left + i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(lLo)), scale));
+                vst1q_f32(left + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(lHi)), scale));
+                vst1q_f32(right + i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(rLo)), scale));
+                vst1q_f32(right + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(rHi)), scale));
+            }
+        }
+        stereoToFloatScalar(pcm16 + 2 * i, mono + i, split ? left + i : nullptr, split ? right + i : nullptr, n - i);
+    }
+
+    float dotNeon(const float *a, const float *b, size_t n) {
+        float32x4_t acc0 = vdupq_n_f32(0.0f);
+        float32x4_t acc1 = vdupq_n_f32(0.0f);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            acc0 = vmlaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+            acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        }
+        float32x4_t acc = vaddq_f32(acc0, acc1);
+        float32x2_t pair = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+        return vget_lane_f32(vpadd_f32(pair, pair), 0) + dotScalar(a + i, b + i, n - i);
+    }
+
+    float absSumNeon(const float *x, size_t n) {
+        float32x4_t acc0 = vdupq_n_f32(0.0f);
+        float32x4_t acc1 = vdupq_n_f32(0.0f);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            acc0 = vaddq_f32(acc0, vabsq_f32(vld1q_f32(x + i)));
+            acc1 = vaddq_f32(acc1, vabsq_f32(vld1q_f32(x + i + 4)));
+        }
+        float32x4_t acc = vaddq_f32(acc0, acc1);
+        float32x2_t pair = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+        return vget_lane_f32(vpadd_f32(pair, pair), 0) + absSumScalar(x + i, n - i);
+    }
+
+#endif
+
+    struct KernelTable {
+        const char *isa;
+
+        void (*monoToFloat)(const int16_t *, float *, size_t);
+
+        void (*stereoToFloat)(const int16_t *, float *, float *, float *, size_t);
+
+        float (*dot)(const float *, const float *, size_t);
+
+        float (*absSum)(const float *, size_t);
+    };
+
+    KernelTable selectKernels() {
+#if defined(AUDIO_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return {"avx2", monoToFloatAvx2, stereoToFloatAvx2, dotAvx2, absSumAvx2};
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return {"sse4.1", monoToFloatSse41, stereoToFloatSse41, dotSse41, absSumSse41};
+        }
+#elif defined(AUDIO_KERNELS_NEON)
+        return {"neon", monoToFloatNeon, stereoToFloatNeon, dotNeon, absSumNeon};
+#endif
+        return {"scalar", monoToFloatScalar, stereoToFloatScalar, dotScalar, absSumScalar};
+    }
+
+    const KernelTable &kernels() {
+        static const KernelTable table = selectKernels();
+        return table;
+    }
+
+}
+
+void AudioKernels::monoToFloat(const int16_t *pcm16, float *out, size_t n) {
+    kernels().monoToFloat(pcm16, out, n);
+}
+
+void AudioKernels::stereoToFloat(const int16_t *pcm16, float *mono, float *left, float *right, size_t n) {
+    kernels().stereoToFloat(pcm16, mono, left, right, n);
+}
+
+float AudioKernels::dot(const float *a, const float *b, size_t n) {
+    return kernels().dot(a, b, n);
+}
+
+float AudioKernels::absSum(const float *x, size_t n) {
+    return kernels().absSum(x, n);
+}
+
+const char *AudioKernels::isa() {
+    return kernels().isa;
+}
@@ -0,0 +1,36 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_AUDIO_KERNELS_H
+#define TRANSCRIBER_AUDIO_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+
+// Sample conversion kernels, dispatched once at startup to the widest instruction set the CPU
+// supports (AVX2 or SSE4.1 on x86, NEON on ARM, scalar otherwise).
+class AudioKernels {
+
+public:
+    // pcm16 -> float in [-1, 1)
+    static void monoToFloat(const int16_t *pcm16, float *out, size_t n);
+
+    // Interleaved stereo pcm16 -> float mono downmix and, when left/right are not null,
+    // the per-channel split, all in a single pass over the input
+    static void stereoToFloat(const int16_t *pcm16, float *mono, float *left, float *right, size_t n);
+
+    // Sum of a[i] * b[i], the inner loop of the polyphase resampler
+    static float dot(const float *a, const float *b, size_t n);
+
+    // Sum of |x[i]|, the per-frame channel energy used for diarization
+    static float absSum(const float *x, size_t n);
+
+    // Name of the instruction set the kernels were dispatched to
+    static const char *isa();
+
+};
+
+
+#endif //TRANSCRIBER_AUDIO_KERNELS_H
@@ -6,84 +6,230 @@
 #define DR_WAV_IMPLEMENTATION
 
 #include "dr_wav.h"
+#include <algorithm>
 #include <iostream>
+#include <cstring>
 #include <string>
 #include <memory>
 
 #include "audio_tooling.h"
+#include "audio_decoder.h"
+#include "audio_kernels.h"
+#include "resampler.h"
 
-#define COMMON_SAMPLE_RATE 16000
+#define WAV_READ_BLOCK_FRAMES 4096
+#define WAV_MAX_RESERVED_FRAMES ((uint64_t) COMMON_SAMPLE_RATE * 60 * 10)
 
 
-void AudioTooling::resampleAudioFile(const std::string& inputFileName, const std::string& outputFileName){
+namespace {
 
-    std::string ffmpegCommand = "ffmpeg -i " + inputFileName + " -loglevel panic -ar 16000 -ac 1 -acodec pcm_s16le " + outputFileName;
-    int result = std::system(ffmpegCommand.c_str());
-    if( result != 0)
-    {
-        throw ResamplingException("Error resampling input file with code : "+ std::to_string(result));
+    // formats drwav_read_pcm_frames_s16 converts itself
+    bool isSupportedWavFormat(uint16_t formatTag) {
+        return formatTag == DR_WAVE_FORMAT_PCM || formatTag == DR_WAVE_FORMAT_IEEE_FLOAT ||
+               formatTag == DR_WAVE_FORMAT_ALAW || formatTag == DR_WAVE_FORMAT_MULAW;
     }
+
+    size_t onWavRead(void *pUserData, void *pBufferOut, size_t bytesToRead) {
+        return static_cast<AudioSource *>(pUserData)->read(static_cast<uint8_t *>(pBufferOut), bytesToRead);
+    }
+
+    drwav_bool32 onWavSeek(void *pUserData, int offset, drwav_seek_origin origin) {
+        auto *source = static_cast<AudioSource *>(pUserData);
+        int64_t target = origin == drwav_seek_origin_current ? source->tell() + offset : offset;
+        return source->seek(target) ? DRWAV_TRUE : DRWAV_FALSE;
+    }
+
+}
+
+void AudioTooling::decodeAudio(const std::string &content, std::vector<float> &pcmf32,
+                               std::vector<std::vector<float>> &pcmf32s, bool stereo) {
+
+    MemoryAudioSource source(content.data(), content.size());
+    decodeAudio(source, pcmf32, pcmf32s, stereo);
+}
+
+void AudioTooling::decodeAudio(AudioSource &source, std::vector<float> &pcmf32,
+                               std::vector<std::vector<float>> &pcmf32s, bool stereo) {
+
+    bool wav = isPreProcessableWav(source);
+
+    if (!source.seek(0)) {
+        throw ResamplingException("could not rewind input");
+    }
+
+    if (wav) {
+        preProcessWav(source, pcmf32, pcmf32s, stereo);
+        return;
+    }
+
+    AudioDecoder::decode(source, pcmf32, pcmf32s, stereo);
+}
+
+bool AudioTooling::isPreProcessableWav(AudioSource &source) {
+
+    uint8_t header[12];
+    size_t headerLength = 0;
+    while (headerLength < sizeof(header)) {
+        size_t n = source.read(header + headerLength, sizeof(header) - headerLength);
+        if (n == 0) {
+            return false;
+        }
+        headerLength += n;
+    }
+
+    if (memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0 || !source.seek(0)) {
+        return false;
+    }
+
+    drwav wav;
+    if (drwav_init(&wav, onWavRead, onWavSeek, &source, nullptr) == false) {
+        return false;
+    }
+
+    bool supported = isSupportedWavFormat(wav.translatedFormatTag) &&
+                     (wav.channels == 1 || wav.channels == 2) &&
+                     PolyphaseResampler::supports(wav.sampleRate, COMMON_SAMPLE_RATE);
+
+    drwav_uninit(&wav);
+    return supported;
 }
 
-void AudioTooling::preProcessWav(const std::string &waveFileName, std::vector<float> &pcmf32,
+void AudioTooling::preProcessWav(AudioSource &source, std::vector<float> &pcmf32,
                                  std::vector<std::vector<float>> &pcmf32s, bool stereo) {
 
     drwav wav;
 
-    if (drwav_init_file(&wav, waveFileName.c_str(), nullptr) == false) {
-        throw WaveToFloatException("failed to open WAV file : " + waveFileName);
+    if (drwav_init(&wav, onWavRead, onWavSeek, &source, nullptr) == false) {
+        throw WaveToFloatException("failed to open WAV data");
     }
 
     if (wav.channels != 1 && wav.channels != 2) {
-        throw WaveToFloatException("WAV file : " + waveFileName + " must be mono or stereo ");
+        drwav_uninit(&wav);
+        throw WaveToFloatException("WAV data must be mono or stereo ");
     }
 
-    if (stereo && wav.channels != 2) {
-        throw WaveToFloatException("WAV file : " + waveFileName + " must be stereo for diarization");
+    // mono files are transcribed as usual, there is just nothing to diarize
+    stereo = stereo && wav.channels == 2;
+
+    if (!PolyphaseResampler::supports(wav.sampleRate, COMMON_SAMPLE_RATE)) {
+        drwav_uninit(&wav);
+        throw WaveToFloatException("WAV sample rate " + std::to_string(wav.sampleRate) + " Hz is not supported");
     }
 
-    if (wav.sampleRate != COMMON_SAMPLE_RATE) {
-        throw WaveToFloatException(
-                "WAV file : " + waveFileName + " must be " + std::to_string(COMMON_SAMPLE_RATE / 1000) + " kHz");
+    if (!isSupportedWavFormat(wav.translatedFormatTag)) {
+        drwav_uninit(&wav);
+        throw WaveToFloatException("WAV data must be PCM, IEEE float, A-law or mu-law");
     }
 
-    if (wav.bitsPerSample != 16) {
-        throw WaveToFloatException("WAV file : " + waveFileName + "  must be 16-bit");
+    const uint32_t channels = wav.channels;
+    const bool resample = wav.sampleRate != COMMON_SAMPLE_RATE;
+
+    std::unique_ptr<PolyphaseResampler> monoResampler;
+    std::unique_ptr<PolyphaseResampler> leftResampler;
+    std::unique_ptr<PolyphaseResampler> rightResampler;
+    if (resample) {
+        monoResampler = std::make_unique<PolyphaseResampler>(wav.sampleRate, COMMON_SAMPLE_RATE);
+        if (stereo) {
+            leftResampler = std::make_unique<PolyphaseResampler>(wav.sampleRate, COMMON_SAMPLE_RATE);
+            rightResampler = std::make_unique<PolyphaseResampler>(wav.sampleRate, COMMON_SAMPLE_RATE);
+        }
     }
 
-    const uint64_t n = wav.totalPCMFrameCount;
+    // streamed WAVs can announce a bogus data size, so the header is only trusted as far as the input goes
+    uint64_t frameLimit = WAV_MAX_RESERVED_FRAMES;
+    if (source.size() >= 0) {
+        frameLimit = (uint64_t) source.size() / (channels * std::max<uint32_t>(1, wav.bitsPerSample / 8));
+    }
+    const auto expectedFrames = (size_t) (std::min<uint64_t>(wav.totalPCMFrameCount, frameLimit) *
+                                          COMMON_SAMPLE_RATE / wav.sampleRate);
+    pcmf32.clear();
+    pcmf32.reserve(expectedFrames);
+    if (stereo) {
+        pcmf32s.assign(2, {});
+        pcmf32s[0].reserve(expectedFrames);
+        pcmf32s[1].reserve(expectedFrames);
+    }
 
-    std::vector<int16_t> pcm16;
-    pcm16.resize(n * wav.channels);
-    drwav_read_pcm_frames_s16(&wav, n, pcm16.data());
-    drwav_uninit(&wav);
+    // convert block by block so the full int16 copy of the file is never materialized
+    int16_t block[WAV_READ_BLOCK_FRAMES * 2];
+    float monoBlock[WAV_READ_BLOCK_FRAMES];
+    float leftBlock[WAV_READ_BLOCK_FRAMES];
+    float rightBlock[WAV_READ_BLOCK_FRAMES];
+
+    auto append = [&](const float *samples, size_t n, std::vector<float> &out, PolyphaseResampler *resampler) {
+        if (resampler != nullptr) {
+            resampler->process(samples, n, out);
+        } else {
+            out.insert(out.end(), samples, samples + n);
+        }
+    };
 
-    // convert to mono, float
-    pcmf32.resize(n);
-    if (wav.channels == 1) {
-        for (uint64_t i = 0; i < n; i++) {
-            pcmf32[i] = float(pcm16[i]) / 32768.0f;
+    while (true) {
+        const auto n = (size_t) drwav_read_pcm_frames_s16(&wav, WAV_READ_BLOCK_FRAMES, block);
+        if (n == 0) {
+            break;
         }
-    } else {
-        for (uint64_t i = 0; i < n; i++) {
-            pcmf32[i] = float(pcm16[2 * i] + pcm16[2 * i + 1]) / 65536.0f;
+
+        if (channels == 1) {
+            AudioKernels::monoToFloat(block, monoBlock, n);
+        } else {
+            AudioKernels::stereoToFloat(block, monoBlock, stereo ? leftBlock : nullptr,
+                                        stereo ? rightBlock : nullptr, n);
+        }
+
+        append(monoBlock, n, pcmf32, monoResampler.get());
+        if (stereo) {
+            append(leftBlock, n, pcmf32s[0], leftResampler.get());
+            append(rightBlock, n, pcmf32s[1], rightResampler.get());
         }
     }
 
-    if (stereo) {
-        // convert to stereo, float
-        pcmf32s.resize(2);
-
-        pcmf32s[0].resize(n);
-        pcmf32s[1].resize(n);
-        for (uint64_t i = 0; i < n; i++) {
-            pcmf32s[0][i] = float(pcm16[2 * i]) / 32768.0f;
-            pcmf32s[1][i] = float(pcm16[2 * i + 1]) / 32768.0f;
+    if (resample) {
+        monoResampler->flush(pcmf32);
+        if (stereo) {
+            leftResampler->flush(pcmf32s[0]);
+            rightResampler->flush(pcmf32s[1]);
         }
     }
+
+    drwav_uninit(&wav);
+}
+
+StreamingAudioDecoder::StreamingAudioDecoder(bool stereo, size_t expectedLength) : source(expectedLength) {
+    decodeThread = std::thread([this, stereo]() {
+        try {
+            std::vector<std::vector<float>> pcmf32s;
+            AudioTooling::decodeAudio(source, pcmf32, pcmf32s, stereo);
+            if (pcmf32s.size() == 2) {
+                channels = ChannelEnergy(pcmf32s[0], pcmf32s[1]);
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        // stop accepting bytes once the decoder no longer reads them
+        source.abort();
+    });
 }
 
+StreamingAudioDecoder::~StreamingAudioDecoder() {
+    source.abort();
+    if (decodeThread.joinable()) {
+        decodeThread.join();
+    }
+}
 
+bool StreamingAudioDecoder::write(const char *data, size_t length) {
+    return source.append(data, length);
+}
 
+void StreamingAudioDecoder::finish(std::vector<float> &outPcmf32, ChannelEnergy &outChannels) {
+    source.close();
+    decodeThread.join();
 
+    if (error) {
+        std::rethrow_exception(error);
+    }
 
+    outPcmf32 = std::move(pcmf32);
+    outChannels = std::move(channels);
+}
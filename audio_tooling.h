@@ -6,32 +6,61 @@
 #define TRANSCRIBER_AUDIO_TOOLING_H
 
 
+#include <exception>
+#include <string>
+#include <thread>
 #include <vector>
+#include "audio_decoder.h"
+#include "channel_energy.h"
+
+#define COMMON_SAMPLE_RATE 16000
 
 
 class AudioTooling {
 
 public:
-    static void resampleAudioFile(const std::string& inputFileName, const std::string& outputFileName);
+    // Decodes an uploaded file held in memory to COMMON_SAMPLE_RATE float PCM without touching disk.
+    // WAV at any common rate is read and resampled natively, everything else goes through libav.
+    static void decodeAudio(const std::string &content, std::vector<float> &pcmf32,
+                            std::vector<std::vector<float>> &pcmf32s, bool stereo);
 
-    static void preProcessWav(const std::string &waveFileName, std::vector<float> &pcmf32,
-                                   std::vector<std::vector<float>> &pcmf32s, bool stereo);
+    static void decodeAudio(AudioSource &source, std::vector<float> &pcmf32,
+                            std::vector<std::vector<float>> &pcmf32s, bool stereo);
 
-    static std::string outputFileRename(std::string inputFileName) {
+    static bool isPreProcessableWav(AudioSource &source);
 
-        // Find the position of the file extension (e.g., ".mp3")
-        size_t dotPos = inputFileName.find_last_of('.');
-        if (dotPos == std::string::npos) {
-            return inputFileName;
-        }
+    static void preProcessWav(AudioSource &source, std::vector<float> &pcmf32,
+                              std::vector<std::vector<float>> &pcmf32s, bool stereo);
 
-        // Get the filename without the extension
-        std::string fileNameWithoutExt = inputFileName.substr(0, dotPos);
+};
 
-        // Create the output filename with the "_resample.wav" extension
-        return fileNameWithoutExt + "_resampled.wav";
-    }
 
+// Decodes an upload on a background thread while its bytes are still being received, so decoding
+// overlaps the network transfer and the body is only held once. With stereo set the channels of a
+// two-channel upload are reduced to their ChannelEnergy on that thread as well.
+class StreamingAudioDecoder {
+
+public:
+    explicit StreamingAudioDecoder(bool stereo, size_t expectedLength = 0);
+
+    ~StreamingAudioDecoder();
+
+    StreamingAudioDecoder(const StreamingAudioDecoder &) = delete;
+
+    StreamingAudioDecoder &operator=(const StreamingAudioDecoder &) = delete;
+
+    // Returns false when the decoder has already stopped and the rest of the upload can be dropped
+    bool write(const char *data, size_t length);
+
+    // Marks the end of the upload, waits for the decoder and rethrows anything it failed with
+    void finish(std::vector<float> &pcmf32, ChannelEnergy &channels);
+
+private:
+    StreamingAudioSource source;
+    std::vector<float> pcmf32;
+    ChannelEnergy channels;
+    std::exception_ptr error;
+    std::thread decodeThread;
 };
 
 
@@ -0,0 +1,52 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "channel_energy.h"
+#include "audio_kernels.h"
+
+#include <algorithm>
+
+
+ChannelEnergy::ChannelEnergy(const std::vector<float> &left, const std::vector<float> &right) {
+    const std::vector<float> *channels[2] = {&left, &right};
+    for (int c = 0; c < 2; c++) {
+        const std::vector<float> &samples = *channels[c];
+        const std::size_t frames = (samples.size() + CHANNEL_ENERGY_FRAME_SAMPLES - 1) / CHANNEL_ENERGY_FRAME_SAMPLES;
+        prefix[c].resize(frames + 1);
+        prefix[c][0] = 0;
+        // frames are summed in float, the running total in double so hours of audio keep their precision
+        for (std::size_t k = 0; k < frames; k++) {
+            const std::size_t start = k * CHANNEL_ENERGY_FRAME_SAMPLES;
+            const std::size_t length = std::min<std::size_t>(CHANNEL_ENERGY_FRAME_SAMPLES, samples.size() - start);
+            prefix[c][k + 1] = prefix[c][k] + AudioKernels::absSum(samples.data() + start, length);
+        }
+    }
+}
+
+double ChannelEnergy::energy(int channel, std::size_t from, std::size_t to) const {
+    const std::size_t last = prefix[channel].size() - 1;
+    from = std::min(from, last);
+    to = std::min(to, last);
+    return to > from ? prefix[channel][to] - prefix[channel][from] : 0;
+}
+
+const char *ChannelEnergy::speaker(int64_t t0, int64_t t1) const {
+    if (empty()) {
+        return "";
+    }
+
+    const auto from = (std::size_t) std::max<int64_t>(0, t0);
+    const auto to = (std::size_t) std::max<int64_t>(0, t1);
+    const double energy0 = energy(0, from, to);
+    const double energy1 = energy(1, from, to);
+
+    // the same 10% margin whisper.cpp's stereo diarization uses
+    if (energy0 > 1.1 * energy1) {
+        return "0";
+    }
+    if (energy1 > 1.1 * energy0) {
+        return "1";
+    }
+    return "?";
+}
@@ -0,0 +1,44 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_CHANNEL_ENERGY_H
+#define TRANSCRIBER_CHANNEL_ENERGY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// samples per frame at COMMON_SAMPLE_RATE, one centisecond like whisper's timestamps
+#define CHANNEL_ENERGY_FRAME_SAMPLES 160
+
+
+// Cumulative |x| of the left and right channel of a stereo upload in 10 ms frames, so the energy of
+// any span is two lookups per channel. Built once while the upload is decoded, after which the
+// channels themselves are no longer needed. Times are on the timeline of the upload, before VAD.
+class ChannelEnergy {
+public:
+    ChannelEnergy() = default;
+
+    // left and right at COMMON_SAMPLE_RATE
+    ChannelEnergy(const std::vector<float> &left, const std::vector<float> &right);
+
+    // mono uploads and requests without diarization
+    [[nodiscard]] bool empty() const { return prefix[0].size() < 2; }
+
+    // "0" or "1" for the channel with clearly more energy over [t0, t1) centiseconds, "?" when neither
+    // dominates, empty without channels
+    [[nodiscard]] const char *speaker(int64_t t0, int64_t t1) const;
+
+    // running sums of channel 0 or 1, empty without channels
+    [[nodiscard]] const std::vector<double> &prefixSums(int channel) const { return prefix[channel]; }
+
+private:
+    [[nodiscard]] double energy(int channel, std::size_t from, std::size_t to) const;
+
+    // prefix[c][k] is the energy of channel c in frames [0, k)
+    std::vector<double> prefix[2];
+};
+
+
+#endif //TRANSCRIBER_CHANNEL_ENERGY_H
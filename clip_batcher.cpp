@@ -0,0 +1,180 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "clip_batcher.h"
+#include "audio_tooling.h"
+
+#include <algorithm>
+
+// whisper's encoder window
+#define BATCH_WINDOW_SAMPLES (WHISPER_CHUNK_SIZE * COMMON_SAMPLE_RATE)
+
+
+ClipBatcher::ClipBatcher(std::chrono::milliseconds maxDelay, std::size_t maxClipSamples, std::size_t guardSamples)
+        : maxDelay(maxDelay),
+          maxClipSamples(std::min<std::size_t>(maxClipSamples, BATCH_WINDOW_SAMPLES)),
+          guardSamples(guardSamples) {
+}
+
+bool ClipBatcher::accepts(const TranscribeParams &params, std::size_t samples) const {
+    // a detected language or a duration limit is per clip, those cannot share a window
+    return maxDelay.count() > 0 && samples > 0 && samples <= maxClipSamples &&
+           !params.detect_language && params.language != "auto" && params.duration_ms <= 0;
+}
+
+std::string ClipBatcher::batchKey(const TranscribeParams &params) {
+    // per-request decoding fields differ between clips, see DecodeProfiles
+    return params.model + '\n' + params.language + '\n' + (params.translate ? "t" : "") + '\n' + params.prompt + '\n' +
+           std::to_string(params.beam_size) + '\n' + std::to_string(params.best_of) + '\n' +
+           (params.no_fallback ? "f" : "") + (params.no_timestamps ? "n" : "") + (params.split_on_word ? "w" : "") +
+           (params.word_timestamps ? "t" : "") + '\n' + std::to_string(params.max_len) + '\n' +
+           std::to_string(params.word_thold) + '\n' + std::to_string(params.entropy_thold) + '\n' +
+           std::to_string(params.logprob_thold) + '\n' + params.priority;
+}
+
+BatchOutcome ClipBatcher::transcribe(TranscriberPool &pool, const TranscribeParams &params,
+                                     const std::vector<float> &pcmf32, const ChannelEnergy &channels,
+                                     const OffsetMap *offsets) {
+    auto start = std::chrono::steady_clock::now();
+    const std::string key = batchKey(params);
+
+    const ChannelEnergy *speakers = params.diarize && !channels.empty() ? &channels : nullptr;
+    Clip clip{&pcmf32, offsets, speakers, 0, params.output_format, ""};
+    std::shared_ptr<Batch> batch;
+    bool leader = false;
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto current = open.find(key);
+    if (current != open.end() && current->second->samples + guardSamples + pcmf32.size() <= BATCH_WINDOW_SAMPLES) {
+        batch = current->second;
+        clip.start = batch->samples + guardSamples;
+        batch->samples = clip.start + pcmf32.size();
+        batch->clips.push_back(&clip);
+        // let the leader go early once nothing else could fit
+        cv.notify_all();
+    } else {
+        batch = std::make_shared<Batch>();
+        // the key holds the model, every clip of a batch was routed to this pool
+        batch->pool = &pool;
+        batch->params = params;
+        batch->samples = pcmf32.size();
+        batch->clips.push_back(&clip);
+        open[key] = batch;
+        leader = true;
+    }
+
+    BatchOutcome outcome;
+    if (leader) {
+        cv.wait_until(lock, start + maxDelay, [&]() {
+            return batch->samples + guardSamples + COMMON_SAMPLE_RATE > BATCH_WINDOW_SAMPLES;
+        });
+        // closed for new clips, a later one starts the next batch
+        auto stillOpen = open.find(key);
+        if (stillOpen != open.end() && stillOpen->second == batch) {
+            open.erase(stillOpen);
+        }
+        lock.unlock();
+
+        try {
+            run(*batch);
+        } catch (...) {
+            batch->error = std::current_exception();
+        }
+
+        lock.lock();
+        batch->done = true;
+        cv.notify_all();
+    } else {
+        cv.wait(lock, [&]() { return batch->done; });
+    }
+
+    if (batch->error) {
+        std::rethrow_exception(batch->error);
+    }
+
+    outcome.body = std::move(clip.body);
+    outcome.clips = batch->clips.size();
+    outcome.waitMs = std::chrono::duration<double, std::milli>(batch->inferenceStart - start).count();
+    return outcome;
+}
+
+void ClipBatcher::run(Batch &batch) {
+    std::vector<float> window(batch.samples, 0.0f);
+    for (const Clip *clip: batch.clips) {
+        std::copy(clip->pcmf32->begin(), clip->pcmf32->end(), window.begin() + (long) clip->start);
+    }
+
+    WorkerLease worker(*batch.pool, TranscriberPool::priorityOf(batch.params, TranscribePriority::Standard));
+    batch.inferenceStart = std::chrono::steady_clock::now();
+
+    TranscribeParams params = batch.params;
+    params.n_threads = worker.threads();
+    // clips are unrelated, earlier ones must not condition the text of later ones
+    params.max_context = 0;
+    // a segment can run across a guard, its tokens are handed out one by one so no clip gets another's words
+    params.word_timestamps = true;
+
+    TranscriptResult result = worker->TranscribeSegments(params, window.data(), window.size());
+
+    // the clip whose share of the window holds time t, guards are split between their neighbours
+    auto ownerOf = [&batch, this](int64_t t) {
+        const int64_t sample = t * COMMON_SAMPLE_RATE / 100;
+        std::size_t owner = 0;
+        for (std::size_t i = 1; i < batch.clips.size(); i++) {
+            if (sample >= (int64_t) (batch.clips[i]->start - guardSamples / 2)) {
+                owner = i;
+            }
+        }
+        return owner;
+    };
+    auto wordOwner = [&ownerOf](const TranscriptWord &word) { return ownerOf((word.t0 + word.t1) / 2); };
+
+    std::vector<TranscriptResult> perClip(batch.clips.size());
+    for (auto &segment: result.segments) {
+        std::vector<TranscriptWord> &words = segment.words;
+        // a segment inside one clip keeps whisper's bounds, parts of a split one take their words' bounds
+        const bool whole = std::all_of(words.begin(), words.end(), [&](const TranscriptWord &word) {
+            return wordOwner(word) == wordOwner(words.front());
+        });
+
+        // consecutive words of one clip become a segment of that clip, the rest of the segment is not its own
+        std::size_t next = 0;
+        while (next < words.size()) {
+            const std::size_t owner = wordOwner(words[next]);
+            TranscriptSegment part;
+            while (next < words.size() && wordOwner(words[next]) == owner) {
+                part.text += words[next].text;
+                part.words.push_back(std::move(words[next]));
+                next++;
+            }
+            part.t0 = whole ? segment.t0 : part.words.front().t0;
+            part.t1 = whole ? segment.t1 : part.words.back().t1;
+            if (!batch.params.word_timestamps) {
+                part.words.clear();
+            }
+
+            const Clip *clip = batch.clips[owner];
+            const auto clipStart = (int64_t) (clip->start * 100 / COMMON_SAMPLE_RATE);
+            const auto clipEnd = (int64_t) (clip->pcmf32->size() * 100 / COMMON_SAMPLE_RATE);
+            const OffsetMap *offsets = clip->offsets && !clip->offsets->empty() ? clip->offsets : nullptr;
+            remapSegment(part, [clipStart, clipEnd, offsets](int64_t t, bool end) {
+                t = std::min(std::max<int64_t>(0, t - clipStart), clipEnd);
+                return offsets ? offsets->toOriginal(t, end) : t;
+            });
+            if (clip->channels) {
+                part.speaker = clip->channels->speaker(part.t0, part.t1);
+            }
+            perClip[owner].segments.push_back(std::move(part));
+        }
+    }
+
+    // clips of one batch may each ask for another output format
+    TranscribeParams clipParams = batch.params;
+    for (std::size_t i = 0; i < batch.clips.size(); i++) {
+        perClip[i].language = result.language;
+        clipParams.output_format = batch.clips[i]->format;
+        batch.clips[i]->body = worker->Render(clipParams, perClip[i]);
+    }
+}
@@ -0,0 +1,79 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_CLIP_BATCHER_H
+#define TRANSCRIBER_CLIP_BATCHER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "transcriber.h"
+#include "vad.h"
+
+
+struct BatchOutcome {
+    // rendered in the clip's own output format
+    std::string body;
+    // time spent collecting the batch and waiting for its worker
+    double waitMs = 0;
+    std::size_t clips = 0;
+};
+
+// Packs short clips arriving within a few milliseconds of each other into one 30 s encoder window,
+// separated by silence guards, and runs a single inference for all of them. The first clip of a batch
+// leads it: it waits up to the batching delay for more clips, leases the worker, and hands every clip
+// the words that fall inside its span of the window, rendered on its own timeline.
+class ClipBatcher {
+public:
+    ClipBatcher(std::chrono::milliseconds maxDelay, std::size_t maxClipSamples, std::size_t guardSamples);
+
+    // Batching is enabled, the clip is short enough and its parameters let it share a window
+    bool accepts(const TranscribeParams &params, std::size_t samples) const;
+
+    // Blocks until the batch holding this clip ran, throws whatever the batch's inference threw
+    BatchOutcome transcribe(TranscriberPool &pool, const TranscribeParams &params, const std::vector<float> &pcmf32,
+                            const ChannelEnergy &channels, const OffsetMap *offsets);
+
+private:
+    struct Clip {
+        const std::vector<float> *pcmf32;
+        const OffsetMap *offsets;
+        // null unless the clip asked for diarization and has channels
+        const ChannelEnergy *channels;
+        std::size_t start;
+        OutputFormat format;
+        std::string body;
+    };
+
+    struct Batch {
+        TranscriberPool *pool = nullptr;
+        TranscribeParams params;
+        std::vector<Clip *> clips;
+        std::size_t samples = 0;
+        std::chrono::steady_clock::time_point inferenceStart;
+        bool done = false;
+        std::exception_ptr error;
+    };
+
+    // Clips share a window only when decoding them together cannot change their results' settings
+    static std::string batchKey(const TranscribeParams &params);
+
+    void run(Batch &batch);
+
+    std::chrono::milliseconds maxDelay;
+    std::size_t maxClipSamples;
+    std::size_t guardSamples;
+
+    std::unordered_map<std::string, std::shared_ptr<Batch>> open;
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+
+
+#endif //TRANSCRIBER_CLIP_BATCHER_H
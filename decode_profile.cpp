@@ -0,0 +1,165 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "decode_profile.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <set>
+
+
+namespace {
+
+    const std::set<std::string> &fieldNames() {
+        static const std::set<std::string> names = {
+                "profile", "language", "detect_language", "translate", "prompt", "beam_size", "best_of",
+                "no_fallback", "no_timestamps", "split_on_word", "max_len", "max_context", "offset_t_ms",
+                "duration_ms", "word_thold", "entropy_thold", "logprob_thold", "vad", "model", "priority",
+                "word_timestamps", "diarize"
+        };
+        return names;
+    }
+
+    int32_t parseInt(const std::string &name, const std::string &value, int32_t min, int32_t max) {
+        char *end = nullptr;
+        long parsed = std::strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end != '\0') {
+            throw DecodeParamsException(name + " must be an integer");
+        }
+        if (parsed < min || parsed > max) {
+            throw DecodeParamsException(
+                    name + " must be between " + std::to_string(min) + " and " + std::to_string(max));
+        }
+        return (int32_t) parsed;
+    }
+
+    float parseFloat(const std::string &name, const std::string &value, float min, float max) {
+        char *end = nullptr;
+        float parsed = std::strtof(value.c_str(), &end);
+        if (value.empty() || *end != '\0' || !std::isfinite(parsed)) {
+            throw DecodeParamsException(name + " must be a number");
+        }
+        if (parsed < min || parsed > max) {
+            throw DecodeParamsException(
+                    name + " must be between " + std::to_string(min) + " and " + std::to_string(max));
+        }
+        return parsed;
+    }
+
+    bool parseBool(const std::string &name, const std::string &value) {
+        std::string lower = value;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        if (lower == "1" || lower == "true" || lower == "yes" || lower == "on") {
+            return true;
+        }
+        if (lower == "0" || lower == "false" || lower == "no" || lower == "off") {
+            return false;
+        }
+        throw DecodeParamsException(name + " must be true or false");
+    }
+
+}
+
+bool DecodeProfiles::isField(const std::string &name) {
+    return fieldNames().count(name) > 0;
+}
+
+void DecodeProfiles::applyProfile(TranscribeParams &params, const std::string &name) {
+    if (name == "default") {
+        return;
+    }
+    // greedy, one candidate and no temperature fallback: a single decoder pass per window
+    if (name == "fast") {
+        params.beam_size = -1;
+        params.best_of = 1;
+        params.no_fallback = true;
+        return;
+    }
+    if (name == "accurate") {
+        params.beam_size = std::max(1, std::min(5, params.max_beam_size));
+        params.best_of = std::max(1, std::min(5, params.max_best_of));
+        params.no_fallback = false;
+        return;
+    }
+    throw DecodeParamsException("unknown profile " + name + ", expected default, fast or accurate");
+}
+
+TranscribeParams DecodeProfiles::resolve(const TranscribeParams &defaults, const DecodeFields &fields) {
+    TranscribeParams params = defaults;
+
+    auto profile = fields.find("profile");
+    if (profile != fields.end()) {
+        applyProfile(params, profile->second);
+        params.profile = profile->second;
+    }
+
+    for (const auto &field: fields) {
+        const std::string &name = field.first;
+        const std::string &value = field.second;
+
+        if (name == "language") {
+            if (value != "auto" && whisper_lang_id(value.c_str()) < 0) {
+                throw DecodeParamsException("unknown language " + value);
+            }
+            params.language = value;
+        } else if (name == "detect_language") {
+            params.detect_language = parseBool(name, value);
+        } else if (name == "translate") {
+            params.translate = parseBool(name, value);
+        } else if (name == "prompt") {
+            if (value.size() > (std::size_t) std::max(0, params.max_prompt_length)) {
+                throw DecodeParamsException(
+                        "prompt is longer than " + std::to_string(params.max_prompt_length) + " bytes");
+            }
+            params.prompt = value;
+        } else if (name == "beam_size") {
+            // -1 selects greedy decoding
+            params.beam_size = parseInt(name, value, -1, std::max(1, params.max_beam_size));
+        } else if (name == "best_of") {
+            params.best_of = parseInt(name, value, 1, std::max(1, params.max_best_of));
+        } else if (name == "no_fallback") {
+            params.no_fallback = parseBool(name, value);
+        } else if (name == "no_timestamps") {
+            params.no_timestamps = parseBool(name, value);
+        } else if (name == "split_on_word") {
+            params.split_on_word = parseBool(name, value);
+        } else if (name == "diarize") {
+            params.diarize = parseBool(name, value);
+        } else if (name == "word_timestamps") {
+            params.word_timestamps = parseBool(name, value);
+        } else if (name == "max_len") {
+            params.max_len = parseInt(name, value, 0, 1000);
+        } else if (name == "max_context") {
+            params.max_context = parseInt(name, value, -1, 224);
+        } else if (name == "offset_t_ms") {
+            params.offset_t_ms = parseInt(name, value, 0, INT32_MAX);
+        } else if (name == "duration_ms") {
+            params.duration_ms = parseInt(name, value, 0, INT32_MAX);
+        } else if (name == "word_thold") {
+            params.word_thold = parseFloat(name, value, 0.0f, 1.0f);
+        } else if (name == "entropy_thold") {
+            params.entropy_thold = parseFloat(name, value, 0.0f, 10.0f);
+        } else if (name == "logprob_thold") {
+            params.logprob_thold = parseFloat(name, value, -10.0f, 0.0f);
+        } else if (name == "vad") {
+            params.vad = parseBool(name, value);
+        } else if (name == "priority") {
+            TranscribePriority priority;
+            if (!TranscriberPool::priorityNamed(value, priority)) {
+                throw DecodeParamsException("priority must be interactive, standard or batch");
+            }
+            params.priority = value;
+        } else if (name == "model") {
+            // checked against the registry when the request is routed
+            params.model_name = value;
+        }
+    }
+
+    if (params.beam_size == 0) {
+        throw DecodeParamsException("beam_size must be -1 or at least 1");
+    }
+    return params;
+}
@@ -0,0 +1,45 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_DECODE_PROFILE_H
+#define TRANSCRIBER_DECODE_PROFILE_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include "transcriber.h"
+
+
+// Decoding settings a caller may pick per request, by field name, e.g. beam_size=5 or profile=fast
+typedef std::map<std::string, std::string> DecodeFields;
+
+// Turns the process-wide TranscribeParams into the ones of a single request. A named profile is applied
+// first and explicit fields on top of it; every value is checked against the limits the server was
+// started with, so a caller can make decoding cheaper but never more expensive than allowed.
+class DecodeProfiles {
+public:
+    // Throws DecodeParamsException naming the first field that is malformed or out of bounds
+    static TranscribeParams resolve(const TranscribeParams &defaults, const DecodeFields &fields);
+
+    // Field names resolve understands, anything else in a request is left alone
+    static bool isField(const std::string &name);
+
+private:
+    static void applyProfile(TranscribeParams &params, const std::string &name);
+};
+
+class DecodeParamsException : public std::exception {
+public:
+    explicit DecodeParamsException(std::string message) : msg(std::move(message)) {}
+
+    [[nodiscard]] const char *what() const noexcept override {
+        return msg.c_str();
+    }
+
+private:
+    std::string msg;
+};
+
+
+#endif //TRANSCRIBER_DECODE_PROFILE_H
@@ -0,0 +1,205 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "job_queue.h"
+
+#include <algorithm>
+#include <functional>
+#include <xid/xid.h>
+
+
+JobQueue::JobQueue(const std::vector<TranscriberPool *> &pools, std::size_t maxPending, std::size_t maxRetained,
+                   std::chrono::seconds retention)
+        : maxPending(maxPending),
+          maxRetained(maxRetained),
+          retention(retention) {
+
+    for (TranscriberPool *pool: pools) {
+        lanes.push_back(std::make_unique<Lane>());
+        lanes.back()->pool = pool;
+    }
+    // one dispatcher per worker keeps every worker busy without queueing twice
+    for (auto &lane: lanes) {
+        for (std::size_t i = 0; i < std::max<std::size_t>(1, lane->pool->stats().size); i++) {
+            dispatchers.emplace_back(&JobQueue::dispatch, this, std::ref(*lane));
+        }
+    }
+}
+
+JobQueue::~JobQueue() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    for (auto &lane: lanes) {
+        lane->cv.notify_all();
+    }
+    for (auto &dispatcher: dispatchers) {
+        dispatcher.join();
+    }
+}
+
+std::string JobQueue::submit(TranscriberPool &pool, TranscribeParams params, std::vector<float> pcmf32,
+                             ChannelEnergy channels, OffsetMap offsets) {
+    auto job = std::make_shared<Job>();
+    job->id = xid::next().string();
+    job->pool = &pool;
+    job->params = std::move(params);
+    job->pcmf32 = std::move(pcmf32);
+    job->channels = std::move(channels);
+    job->offsets = std::move(offsets);
+    job->submittedAt = std::chrono::steady_clock::now();
+
+    auto lane = std::find_if(lanes.begin(), lanes.end(),
+                             [&pool](const std::unique_ptr<Lane> &candidate) { return candidate->pool == &pool; });
+    if (lane == lanes.end()) {
+        throw TranscribeException("no job dispatchers for model " + job->params.model_name);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (pending >= maxPending) {
+            rejected++;
+            throw JobQueueFullException("too many pending jobs");
+        }
+        evictLocked();
+        jobs[job->id] = job;
+        (*lane)->pending.push_back(job);
+        pending++;
+        submitted++;
+    }
+    (*lane)->cv.notify_one();
+    return job->id;
+}
+
+bool JobQueue::lookup(const std::string &id, JobSnapshot &snapshot) {
+    std::unique_lock<std::mutex> lock(mutex);
+    evictLocked();
+
+    auto found = jobs.find(id);
+    if (found == jobs.end()) {
+        return false;
+    }
+
+    const Job &job = *found->second;
+    auto now = std::chrono::steady_clock::now();
+    auto started = job.status == JobStatus::Queued ? now : job.startedAt;
+    auto finishedAt = job.status == JobStatus::Done || job.status == JobStatus::Failed ? job.finishedAt : now;
+
+    snapshot.id = job.id;
+    snapshot.status = job.status;
+    snapshot.result = job.result;
+    snapshot.error = job.error;
+    snapshot.queueMs = std::chrono::duration<double, std::milli>(started - job.submittedAt).count();
+    snapshot.serviceMs = std::chrono::duration<double, std::milli>(finishedAt - started).count();
+    return true;
+}
+
+JobQueueStats JobQueue::stats() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    JobQueueStats stats;
+    stats.pending = pending;
+    stats.running = running;
+    stats.retained = finished.size();
+    stats.submitted = submitted;
+    stats.rejected = rejected;
+    return stats;
+}
+
+const char *JobQueue::statusName(JobStatus status) {
+    switch (status) {
+        case JobStatus::Queued:
+            return "queued";
+        case JobStatus::Running:
+            return "running";
+        case JobStatus::Done:
+            return "done";
+        case JobStatus::Failed:
+            return "failed";
+    }
+    return "unknown";
+}
+
+void JobQueue::dispatch(Lane &lane) {
+    while (true) {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            lane.cv.wait(lock, [this, &lane]() { return stopping || !lane.pending.empty(); });
+            if (stopping) {
+                return;
+            }
+            job = lane.pending.front();
+            lane.pending.pop_front();
+            pending--;
+        }
+
+        try {
+            // backfill by default, live traffic goes first while jobs wait. The job was admitted when it was
+            // submitted, so it waits for a worker as long as it takes without using up the HTTP queue limits.
+            TranscribeWorker *acquired = job->pool->acquireBacklog(
+                    TranscriberPool::priorityOf(job->params, TranscribePriority::Batch), stopping);
+            if (acquired == nullptr) {
+                return;
+            }
+            WorkerLease worker(*job->pool, acquired);
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                job->status = JobStatus::Running;
+                job->startedAt = std::chrono::steady_clock::now();
+                running++;
+            }
+
+            TranscribeParams jobParams = job->params;
+            jobParams.n_threads = worker.threads();
+            std::string output = job->pool->transcribeSplit(worker, jobParams, job->pcmf32, job->channels, &job->offsets);
+            finish(job, JobStatus::Done, std::move(output));
+
+        } catch (const std::exception &e) {
+            finish(job, JobStatus::Failed, e.what());
+        }
+    }
+}
+
+void JobQueue::finish(const std::shared_ptr<Job> &job, JobStatus status, std::string output) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (job->status == JobStatus::Running) {
+        running--;
+    }
+
+    job->finishedAt = std::chrono::steady_clock::now();
+    if (job->status == JobStatus::Queued) {
+        job->startedAt = job->finishedAt;
+    }
+    job->status = status;
+    if (status == JobStatus::Done) {
+        job->result = std::move(output);
+    } else {
+        job->error = std::move(output);
+    }
+
+    // the audio is no longer needed once the job ran
+    job->pcmf32 = std::vector<float>();
+    job->channels = ChannelEnergy();
+
+    finished.push_back(job->id);
+    evictLocked();
+}
+
+void JobQueue::evictLocked() {
+    auto now = std::chrono::steady_clock::now();
+    while (!finished.empty()) {
+        auto oldest = jobs.find(finished.front());
+        bool expired = oldest == jobs.end() || now - oldest->second->finishedAt > retention;
+        if (!expired && finished.size() <= maxRetained) {
+            break;
+        }
+        if (oldest != jobs.end()) {
+            jobs.erase(oldest);
+        }
+        finished.pop_front();
+    }
+}
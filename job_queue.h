@@ -0,0 +1,138 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_JOB_QUEUE_H
+#define TRANSCRIBER_JOB_QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "transcriber.h"
+#include "vad.h"
+
+
+enum class JobStatus {
+    Queued,
+    Running,
+    Done,
+    Failed
+};
+
+// Point-in-time copy of a job, safe to serialize without holding the queue lock
+struct JobSnapshot {
+    std::string id;
+    JobStatus status = JobStatus::Queued;
+    std::string result;
+    std::string error;
+    double queueMs = 0;
+    double serviceMs = 0;
+};
+
+struct JobQueueStats {
+    std::size_t pending = 0;
+    std::size_t running = 0;
+    std::size_t retained = 0;
+    uint64_t submitted = 0;
+    uint64_t rejected = 0;
+};
+
+// Transcription jobs submitted over HTTP and run by dispatcher threads that feed the TranscriberPools,
+// so a connection thread is only held while the upload is received. Every pool has its own queue and
+// dispatchers, a backlog on a slow model does not hold up jobs for the others. Finished jobs are kept
+// for polling until they expire or the retention limit evicts the oldest of them.
+class JobQueue {
+public:
+    // One dispatcher per worker of each pool, jobs can only be submitted for these pools
+    JobQueue(const std::vector<TranscriberPool *> &pools, std::size_t maxPending, std::size_t maxRetained,
+             std::chrono::seconds retention);
+
+    ~JobQueue();
+
+    JobQueue(const JobQueue &) = delete;
+
+    JobQueue &operator=(const JobQueue &) = delete;
+
+    // Queues decoded audio for the pool of the model it was routed to and returns the job id, throws JobQueueFullException when too many jobs are pending
+    std::string submit(TranscriberPool &pool, TranscribeParams params, std::vector<float> pcmf32, ChannelEnergy channels,
+                       OffsetMap offsets = {});
+
+    // False when the id is unknown or its result already expired
+    bool lookup(const std::string &id, JobSnapshot &snapshot);
+
+    JobQueueStats stats();
+
+    static const char *statusName(JobStatus status);
+
+private:
+    struct Job {
+        std::string id;
+        JobStatus status = JobStatus::Queued;
+        TranscriberPool *pool = nullptr;
+        TranscribeParams params;
+        std::vector<float> pcmf32;
+        ChannelEnergy channels;
+        OffsetMap offsets;
+        std::string result;
+        std::string error;
+        std::chrono::steady_clock::time_point submittedAt;
+        std::chrono::steady_clock::time_point startedAt;
+        std::chrono::steady_clock::time_point finishedAt;
+    };
+
+    // the jobs of one pool and the dispatchers feeding it
+    struct Lane {
+        TranscriberPool *pool;
+        std::deque<std::shared_ptr<Job>> pending;
+        std::condition_variable cv;
+    };
+
+    void dispatch(Lane &lane);
+
+    void finish(const std::shared_ptr<Job> &job, JobStatus status, std::string output);
+
+    void evictLocked();
+
+    std::size_t maxPending;
+    std::size_t maxRetained;
+    std::chrono::seconds retention;
+
+    std::vector<std::unique_ptr<Lane>> lanes;
+    // jobs queued in all lanes together
+    std::size_t pending = 0;
+    std::unordered_map<std::string, std::shared_ptr<Job>> jobs;
+    // finished job ids, oldest first
+    std::deque<std::string> finished;
+    std::size_t running = 0;
+    uint64_t submitted = 0;
+    uint64_t rejected = 0;
+    // read by dispatchers waiting for a worker outside the lock
+    std::atomic<bool> stopping{false};
+
+    std::mutex mutex;
+    std::vector<std::thread> dispatchers;
+};
+
+class JobQueueFullException : public std::exception {
+public:
+    explicit JobQueueFullException(std::string message) : msg(std::move(message)) {}
+
+    [[nodiscard]] const char *what() const noexcept override {
+        return msg.c_str();
+    }
+
+private:
+    std::string msg;
+};
+
+
+#endif //TRANSCRIBER_JOB_QUEUE_H
@@ -0,0 +1,255 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "json_writer.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define JSON_WRITER_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#define JSON_WRITER_NEON
+#include <arm_neon.h>
+#endif
+
+
+namespace {
+
+    const char HEX_DIGITS[] = "0123456789abcdef";
+
+    inline bool needsEscape(unsigned char c) {
+        return c < 0x20 || c == '"' || c == '\\';
+    }
+
+    // Bytes before the first one that needs escaping, at most length
+    inline std::size_t plainPrefix(const char *value, std::size_t length) {
+        std::size_t i = 0;
+#if defined(JSON_WRITER_SSE2)
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i control = _mm_set1_epi8(0x1f);
+        for (; i + 16 <= length; i += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(value + i));
+            // unsigned c <= 0x1f is max(c, 0x1f) == 0x1f, a signed compare would flag UTF-8 bytes too
+            __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                                           _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+            int mask = _mm_movemask_epi8(special);
+            if (mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+#elif defined(JSON_WRITER_NEON)
+        const uint8x16_t quote = vdupq_n_u8('"');
+        const uint8x16_t backslash = vdupq_n_u8('\\');
+        const uint8x16_t control = vdupq_n_u8(0x20);
+        for (; i + 16 <= length; i += 16) {
+            uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t *>(value + i));
+            uint8x16_t special = vorrq_u8(vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash)),
+                                          vcltq_u8(chunk, control));
+            if (vmaxvq_u8(special) != 0) {
+                break;
+            }
+        }
+#endif
+        for (; i < length; i++) {
+            if (needsEscape((unsigned char) value[i])) {
+                return i;
+            }
+        }
+        return length;
+    }
+
+    inline void appendDigits(char *at, int64_t value, int width) {
+        for (int i = width - 1; i >= 0; i--) {
+            at[i] = (char) ('0' + value % 10);
+            value /= 10;
+        }
+    }
+
+}
+
+JsonWriter::JsonWriter(std::string &out, bool pretty)
+        : out(out),
+          pretty(pretty) {
+    first[0] = true;
+}
+
+void JsonWriter::element(const char *key) {
+    if (!first[depth]) {
+        out.push_back(',');
+    }
+    first[depth] = false;
+
+    if (pretty && depth > 0) {
+        out.push_back('\n');
+        out.append((std::size_t) depth, '\t');
+    }
+
+    if (key) {
+        out.push_back('"');
+        out.append(key);
+        out.append(pretty ? "\": " : "\":");
+    }
+}
+
+void JsonWriter::open(const char *key, char bracket) {
+    // deeper nesting than any document this server writes
+    if (depth + 1 >= JSON_WRITER_MAX_DEPTH) {
+        throw JsonWriterException("JSON nested deeper than " + std::to_string(JSON_WRITER_MAX_DEPTH) + " levels");
+    }
+    element(key);
+    out.push_back(bracket);
+    first[++depth] = true;
+}
+
+void JsonWriter::close(char bracket) {
+    if (depth == 0) {
+        throw JsonWriterException(std::string("unbalanced ") + bracket);
+    }
+    const bool empty = first[depth];
+    depth--;
+    if (pretty && !empty) {
+        out.push_back('\n');
+        out.append((std::size_t) depth, '\t');
+    }
+    out.push_back(bracket);
+}
+
+JsonWriter &JsonWriter::beginObject(const char *key) {
+    open(key, '{');
+    return *this;
+}
+
+JsonWriter &JsonWriter::endObject() {
+    close('}');
+    return *this;
+}
+
+JsonWriter &JsonWriter::beginArray(const char *key) {
+    open(key, '[');
+    return *this;
+}
+
+JsonWriter &JsonWriter::endArray() {
+    close(']');
+    return *this;
+}
+
+JsonWriter &JsonWriter::string(const char *key, const char *value, std::size_t length) {
+    element(key);
+    out.push_back('"');
+    escape(out, value, length);
+    out.push_back('"');
+    return *this;
+}
+
+JsonWriter &JsonWriter::string(const char *key, const std::string &value) {
+    return string(key, value.data(), value.size());
+}
+
+JsonWriter &JsonWriter::string(const char *key, const char *value) {
+    return string(key, value ? value : "", value ? strlen(value) : 0);
+}
+
+JsonWriter &JsonWriter::number(const char *key, int64_t value) {
+    element(key);
+    char digits[24];
+    auto written = std::to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, written.ptr);
+    return *this;
+}
+
+JsonWriter &JsonWriter::decimal(const char *key, double value, int precision) {
+    element(key);
+    // JSON has no NaN or infinity
+    if (!std::isfinite(value)) {
+        value = 0;
+    }
+    // the floating point to_chars overloads need GCC 11, the image builds with 10
+    char digits[64];
+    int length = snprintf(digits, sizeof(digits), "%.*f", precision, value);
+    out.append(digits, std::min<std::size_t>(std::max(length, 0), sizeof(digits) - 1));
+    return *this;
+}
+
+JsonWriter &JsonWriter::boolean(const char *key, bool value) {
+    element(key);
+    out.append(value ? "true" : "false");
+    return *this;
+}
+
+JsonWriter &JsonWriter::timestamp(const char *key, int64_t t, bool comma) {
+    element(key);
+    out.push_back('"');
+    appendTimestamp(out, t, comma);
+    out.push_back('"');
+    return *this;
+}
+
+void JsonWriter::escape(std::string &out, const char *value, std::size_t length) {
+    while (length > 0) {
+        std::size_t plain = plainPrefix(value, length);
+        out.append(value, plain);
+        if (plain == length) {
+            return;
+        }
+
+        const auto c = (unsigned char) value[plain];
+        switch (c) {
+            case '"':
+                out.append("\\\"");
+                break;
+            case '\\':
+                out.append("\\\\");
+                break;
+            case '\n':
+                out.append("\\n");
+                break;
+            case '\r':
+                out.append("\\r");
+                break;
+            case '\t':
+                out.append("\\t");
+                break;
+            default: {
+                const char unicode[] = {'\\', 'u', '0', '0', HEX_DIGITS[c >> 4], HEX_DIGITS[c & 0xf]};
+                out.append(unicode, sizeof(unicode));
+            }
+        }
+
+        value += plain + 1;
+        length -= plain + 1;
+    }
+}
+
+void JsonWriter::appendTimestamp(std::string &out, int64_t t, bool comma) {
+    int64_t msec = t < 0 ? 0 : t * 10;
+    int64_t hr = msec / (1000 * 60 * 60);
+    msec -= hr * (1000 * 60 * 60);
+    int64_t min = msec / (1000 * 60);
+    msec -= min * (1000 * 60);
+    int64_t sec = msec / 1000;
+    msec -= sec * 1000;
+
+    // recordings past 99 hours widen the hours instead of wrapping
+    const int hourWidth = hr > 99 ? (int) std::to_string(hr).size() : 2;
+    char buf[32];
+    appendDigits(buf, hr, hourWidth);
+    char *at = buf + hourWidth;
+    *at++ = ':';
+    appendDigits(at, min, 2);
+    at += 2;
+    *at++ = ':';
+    appendDigits(at, sec, 2);
+    at += 2;
+    *at++ = comma ? ',' : '.';
+    appendDigits(at, msec, 3);
+    at += 3;
+    out.append(buf, at);
+}
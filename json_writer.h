@@ -0,0 +1,84 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_JSON_WRITER_H
+#define TRANSCRIBER_JSON_WRITER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <string>
+
+#define JSON_WRITER_MAX_DEPTH 32
+
+
+// Append-only JSON serializer writing straight into a caller-owned string. Commas and indentation are
+// tracked per nesting level, so callers only name keys and values; keys are written as given and have to
+// be plain identifiers. Nothing is allocated besides the growth of the output string itself.
+class JsonWriter {
+public:
+    // pretty indents with tabs, one member per line, compact writes everything on one line
+    explicit JsonWriter(std::string &out, bool pretty = true);
+
+    // key is null for array elements and the top-level value. Nesting deeper than JSON_WRITER_MAX_DEPTH,
+    // or ending more than was begun, throws JsonWriterException.
+    JsonWriter &beginObject(const char *key = nullptr);
+
+    JsonWriter &endObject();
+
+    JsonWriter &beginArray(const char *key = nullptr);
+
+    JsonWriter &endArray();
+
+    JsonWriter &string(const char *key, const char *value, std::size_t length);
+
+    JsonWriter &string(const char *key, const std::string &value);
+
+    // null writes an empty string
+    JsonWriter &string(const char *key, const char *value);
+
+    JsonWriter &number(const char *key, int64_t value);
+
+    // Fixed notation with precision digits after the point
+    JsonWriter &decimal(const char *key, double value, int precision = 3);
+
+    JsonWriter &boolean(const char *key, bool value);
+
+    // Centiseconds as a quoted HH:MM:SS,mmm (or HH:MM:SS.mmm) string
+    JsonWriter &timestamp(const char *key, int64_t t, bool comma = true);
+
+    // Appends value escaped for a JSON string: quotes, backslashes and control characters.
+    // Runs of plain bytes are found 16 at a time with SSE2 or NEON and copied in one go.
+    static void escape(std::string &out, const char *value, std::size_t length);
+
+    // Appends HH:MM:SS,mmm for t centiseconds without going through printf
+    static void appendTimestamp(std::string &out, int64_t t, bool comma = true);
+
+private:
+    void element(const char *key);
+
+    void open(const char *key, char bracket);
+
+    void close(char bracket);
+
+    std::string &out;
+    bool pretty;
+    int depth = 0;
+    bool first[JSON_WRITER_MAX_DEPTH];
+};
+
+class JsonWriterException : public std::exception {
+public:
+    explicit JsonWriterException(std::string message) : msg(std::move(message)) {}
+
+    [[nodiscard]] const char *what() const noexcept override {
+        return msg.c_str();
+    }
+
+private:
+    std::string msg;
+};
+
+
+#endif //TRANSCRIBER_JSON_WRITER_H
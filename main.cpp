@@ -8,11 +8,27 @@
 #include "utilities.h"
 #include "transcriber.h"
 #include "audio_tooling.h"
+#include "audio_kernels.h"
+#include "resampler.h"
+#include "job_queue.h"
+#include "realtime_session.h"
+#include "vad.h"
+#include "clip_batcher.h"
+#include "result_cache.h"
+#include "decode_profile.h"
+#include "model_registry.h"
+#include "json_writer.h"
+#include "transcript_format.h"
+#include "response_compression.h"
 #include <cmath>
-#include <xid/xid.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <memory>
 #include <cstdio>
+#include <sstream>
+#include <thread>
 
 #define CPPHTTPLIB_USE_POLL
 
@@ -20,6 +36,9 @@
 
 #define SERVER_CERT_FILE "./cert.pem"
 #define SERVER_PRIVATE_KEY_FILE "./key.pem"
+#define MAX_UPLOAD_SIZE (1024 * 1024 * 128)
+// longest decoding field accepted from a form part
+#define MAX_FIELD_SIZE (1024 * 64)
 
 using namespace httplib;
 using namespace std;
@@ -38,6 +57,353 @@ void signalHandler(int signum) {
 }
 
 
+// Decoding fields from X-Transcribe-<field> headers (beam-size for beam_size), overridden by the query string
+DecodeFields requestedDecodeFields(const Request &req) {
+    DecodeFields fields;
+    for (const auto &header: req.headers) {
+        const std::string prefix = "x-transcribe-";
+        if (header.first.size() <= prefix.size() ||
+            !std::equal(prefix.begin(), prefix.end(), header.first.begin(),
+                        [](char a, char b) { return a == ::tolower(b); })) {
+            continue;
+        }
+        std::string name = header.first.substr(prefix.size());
+        std::transform(name.begin(), name.end(), name.begin(), [](char c) { return c == '-' ? '_' : ::tolower(c); });
+        if (DecodeProfiles::isField(name)) {
+            fields[name] = header.second;
+        }
+    }
+    for (const auto &param: req.params) {
+        if (DecodeProfiles::isField(param.first)) {
+            fields[param.first] = param.second;
+        }
+    }
+    return fields;
+}
+
+// Scheduling class asked for by header or query, for admission before the upload is read. Form fields and
+// malformed values are left to DecodeProfiles::resolve, which sees the whole request.
+TranscribePriority requestedPriority(const Request &req, TranscribePriority fallback) {
+    DecodeFields fields = requestedDecodeFields(req);
+    auto name = fields.find("priority");
+    TranscribePriority priority = fallback;
+    if (name != fields.end() && TranscriberPool::priorityNamed(name->second, priority)) {
+        return priority;
+    }
+    return fallback;
+}
+
+// Channels are only kept while decoding when diarization is asked for before the audio arrives: by default,
+// header, query or a form field sent ahead of audio_file. A diarize field after it comes too late to decode
+// the channels, the upload is then transcribed without speakers.
+bool requestedDiarize(const TranscribeParams &params, const DecodeFields &fields) {
+    auto field = fields.find("diarize");
+    if (field == fields.end()) {
+        return params.diarize;
+    }
+    try {
+        return DecodeProfiles::resolve(params, {*field}).diarize;
+    } catch (const DecodeParamsException &) {
+        // rejected once the whole request is resolved
+        return params.diarize;
+    }
+}
+
+// Streams the upload into the decoder, from the first audio_file part or from the raw body,
+// audio is decoded on a background thread while the body is still arriving. Other form parts named
+// like a decoding field are collected into fields, on top of what headers and query already set.
+// The decoder starts with the audio, so the fields sent ahead of it decide whether channels are kept.
+void receiveAudio(const Request &req, const ContentReader &content_reader, const TranscribeParams &params,
+                  std::vector<float> &pcmf32, ChannelEnergy &channels, DecodeFields &fields, double &uploadMs,
+                  double &decodeMs) {
+
+    auto uploadStart = std::chrono::steady_clock::now();
+
+    std::unique_ptr<StreamingAudioDecoder> decoder;
+    auto startDecoder = [&]() {
+        decoder = std::make_unique<StreamingAudioDecoder>(
+                requestedDiarize(params, fields),
+                std::min<uint64_t>(req.get_header_value<uint64_t>("Content-Length"), MAX_UPLOAD_SIZE));
+    };
+    bool hasAudio = false;
+
+    if (req.is_multipart_form_data()) {
+        bool inAudioPart = false;
+        std::string *field = nullptr;
+        bool fieldTooLong = false;
+        content_reader(
+                [&](const MultipartFormData &file) {
+                    // only the first audio_file part is decoded
+                    inAudioPart = !hasAudio && file.name == "audio_file";
+                    hasAudio = hasAudio || inAudioPart;
+                    if (inAudioPart) {
+                        startDecoder();
+                    }
+                    field = nullptr;
+                    if (!inAudioPart && file.filename.empty() && DecodeProfiles::isField(file.name)) {
+                        field = &fields[file.name];
+                        field->clear();
+                    }
+                    return true;
+                },
+                [&](const char *data, size_t data_length) {
+                    if (field) {
+                        if (field->size() + data_length > MAX_FIELD_SIZE) {
+                            fieldTooLong = true;
+                            return false;
+                        }
+                        field->append(data, data_length);
+                        return true;
+                    }
+                    return !inAudioPart || decoder->write(data, data_length);
+                });
+        if (fieldTooLong) {
+            throw DecodeParamsException("form field is too long");
+        }
+    } else {
+        startDecoder();
+        content_reader([&](const char *data, size_t data_length) {
+            hasAudio = true;
+            return decoder->write(data, data_length);
+        });
+    }
+
+    if (!hasAudio) {
+        throw ResamplingException("request has no audio_file");
+    }
+
+    auto decodeStart = std::chrono::steady_clock::now();
+    decoder->finish(pcmf32, channels);
+    auto decodeEnd = std::chrono::steady_clock::now();
+
+    uploadMs = std::chrono::duration<double, std::milli>(decodeStart - uploadStart).count();
+    decodeMs = std::chrono::duration<double, std::milli>(decodeEnd - decodeStart).count();
+}
+
+struct VadStats {
+    std::atomic<uint64_t> inputSamples{0};
+    std::atomic<uint64_t> skippedSamples{0};
+};
+
+// Cuts offset_t_ms from the start and drops long silences when ENV_VAD is set, the returned offsets map
+// timestamps back to the upload. Whisper would count the offset on the compacted audio, and again from the
+// start of every chunk of a split request or of the window a batch shares, so it is applied here instead.
+VadResult removeSilence(TranscribeParams &params, std::vector<float> &pcmf32, VadStats &stats) {
+    const std::size_t skipped = (std::size_t) std::max(0, params.offset_t_ms) * COMMON_SAMPLE_RATE / 1000;
+    if (skipped > 0 && skipped >= pcmf32.size()) {
+        throw DecodeParamsException("offset_t_ms is past the end of the audio");
+    }
+    params.offset_t_ms = 0;
+    pcmf32.erase(pcmf32.begin(), pcmf32.begin() + (std::ptrdiff_t) skipped);
+
+    VadResult vad;
+    if (params.vad) {
+        VadParams vadParams;
+        vadParams.threshold_db = params.vad_threshold_db;
+        vadParams.min_silence_ms = params.vad_min_silence_ms;
+        vadParams.padding_ms = params.vad_padding_ms;
+
+        vad = VoiceActivityDetector::compact(pcmf32, vadParams);
+        stats.inputSamples += vad.inputSamples;
+        stats.skippedSamples += vad.inputSamples - vad.keptSamples;
+    }
+    vad.offsets.shift(skipped, pcmf32.size());
+    return vad;
+}
+
+std::string vadTiming(const TranscribeParams &params, const VadResult &vad) {
+    if (!params.vad) {
+        return "";
+    }
+    char desc[32];
+    snprintf(desc, sizeof(desc), "skipped %.1f%%", vad.skippedRatio() * 100.0);
+    return ", vad;dur=" + std::to_string(vad.durationMs) + ";desc=\"" + desc + "\"";
+}
+
+struct CachePolicy {
+    bool lookup = true;
+    bool store = true;
+};
+
+// Cache-Control: no-cache transcribes again and refreshes the stored result, no-store leaves the cache alone
+CachePolicy requestedCachePolicy(const Request &req) {
+    std::string control = req.get_header_value("Cache-Control");
+    CachePolicy policy;
+    if (control.find("no-store") != std::string::npos) {
+        policy.lookup = false;
+        policy.store = false;
+    } else if (control.find("no-cache") != std::string::npos) {
+        policy.lookup = false;
+    }
+    return policy;
+}
+
+enum class StreamFormat {
+    None,
+    NdJson,
+    EventStream
+};
+
+// ?stream=ndjson|sse, or an Accept header asking for either media type
+StreamFormat requestedStreamFormat(const Request &req) {
+    std::string stream = req.get_param_value("stream");
+    if (stream == "ndjson") {
+        return StreamFormat::NdJson;
+    }
+    if (stream == "sse") {
+        return StreamFormat::EventStream;
+    }
+
+    std::string accept = req.get_header_value("Accept");
+    if (accept.find("text/event-stream") != std::string::npos) {
+        return StreamFormat::EventStream;
+    }
+    if (accept.find("application/x-ndjson") != std::string::npos) {
+        return StreamFormat::NdJson;
+    }
+    return StreamFormat::None;
+}
+
+// ?format=json|json-min|ndjson|srt|vtt|binary, or an Accept header naming a subtitle or the binary media type.
+// False for a format this server cannot write.
+bool requestedOutputFormat(const Request &req, OutputFormat &format) {
+    format = OutputFormat::Json;
+    if (req.has_param("format")) {
+        return TranscriptFormats::named(req.get_param_value("format"), format);
+    }
+
+    std::string accept = req.get_header_value("Accept");
+    if (accept.find("application/x-subrip") != std::string::npos || accept.find("text/srt") != std::string::npos) {
+        format = OutputFormat::Srt;
+    } else if (accept.find("text/vtt") != std::string::npos) {
+        format = OutputFormat::Vtt;
+    } else if (accept.find("application/x-transcript-segments") != std::string::npos) {
+        format = OutputFormat::Binary;
+    }
+    return true;
+}
+
+std::string streamEvent(StreamFormat format, const char *event, const std::string &json) {
+    if (format == StreamFormat::EventStream) {
+        return std::string("event: ") + event + "\ndata: " + json + "\n\n";
+    }
+    return json + "\n";
+}
+
+// Exception messages can hold quotes, backslashes or control characters, a stream line must stay valid JSON
+std::string errorJson(const char *error, const std::string &reason) {
+    std::string json;
+    JsonWriter(json, false)
+            .beginObject()
+            .string("error", error)
+            .string("reason", reason)
+            .endObject();
+    return json;
+}
+
+std::string segmentJson(const TranscriptSegment &segment) {
+    std::string json;
+    json.reserve(96 + segment.text.size() + segment.words.size() * 64);
+    JsonWriter writer(json, false);
+    writer.beginObject()
+            .beginObject("timestamps")
+            .timestamp("from", segment.t0)
+            .timestamp("to", segment.t1)
+            .endObject()
+            .beginObject("offsets")
+            .number("from", segment.t0 * 10)
+            .number("to", segment.t1 * 10)
+            .endObject()
+            .string("text", segment.text);
+    TranscriptFormats::annotations(writer, segment);
+    writer.endObject();
+    return json;
+}
+
+// Hands a finished body to the response, compressed when the client accepts it and it is large enough.
+// set_content would copy it.
+void setBody(const Request &req, Response &res, ResponseCompression &compression, std::string &&body,
+             const char *contentType = "text/json") {
+    ContentEncoding encoding = compression.compress(req.get_header_value("Accept-Encoding"), body);
+    if (encoding != ContentEncoding::Identity) {
+        res.set_header("Content-Encoding", ResponseCompression::name(encoding));
+    }
+    res.set_header("Vary", "Accept-Encoding");
+    res.body = std::move(body);
+    res.set_header("Content-Type", contentType);
+}
+
+// Writes one piece of a chunked response, compressed and flushed when the response is encoded
+bool writeChunk(DataSink &sink, const std::shared_ptr<CompressionStream> &encoder, const std::string &chunk) {
+    if (!encoder) {
+        return sink.write(chunk.data(), chunk.size());
+    }
+    std::string compressed;
+    encoder->write(chunk.data(), chunk.size(), compressed);
+    return sink.write(compressed.data(), compressed.size());
+}
+
+// Ends a chunked response
+void finishChunks(DataSink &sink, const std::shared_ptr<CompressionStream> &encoder) {
+    if (encoder) {
+        std::string tail;
+        encoder->finish(tail);
+        sink.write(tail.data(), tail.size());
+    }
+    sink.done();
+}
+
+// Encoder for a chunked response, announced in the headers before the first chunk
+std::shared_ptr<CompressionStream> chunkEncoder(const Request &req, Response &res, ResponseCompression &compression) {
+    std::shared_ptr<CompressionStream> encoder = compression.stream(req.get_header_value("Accept-Encoding"));
+    if (encoder) {
+        res.set_header("Content-Encoding", ResponseCompression::name(encoder->encoding()));
+    }
+    res.set_header("Vary", "Accept-Encoding");
+    return encoder;
+}
+
+// Runs the transcription while the response is written, every segment goes out as soon as whisper
+// finalizes it. A failed write means the client is gone, which cancels the remaining windows.
+void streamTranscription(Response &res, StreamFormat format, const std::shared_ptr<WorkerLease> &worker,
+                         const std::shared_ptr<CompressionStream> &encoder, const TranscribeParams &params,
+                         std::vector<float> pcmf32, ChannelEnergy channels, OffsetMap offsets) {
+
+    auto audio = std::make_shared<std::pair<std::vector<float>, ChannelEnergy>>(std::move(pcmf32),
+                                                                               std::move(channels));
+    auto offsetMap = std::make_shared<OffsetMap>(std::move(offsets));
+
+    res.set_header("Cache-Control", "no-cache");
+    res.set_chunked_content_provider(
+            format == StreamFormat::EventStream ? "text/event-stream" : "application/x-ndjson",
+            [worker, encoder, requestParams = params, audio, offsetMap, format](size_t /*offset*/,
+                                                                              DataSink &sink) mutable {
+                bool connected = true;
+                try {
+                    // the segments are already out, the rendered document would only be thrown away
+                    (*worker)->TranscribeSegments(requestParams, audio->first.data(), audio->first.size(),
+                                                  [&](const TranscriptSegment &segment) {
+                                                      connected = writeChunk(sink, encoder, streamEvent(
+                                                              format, "segment", segmentJson(segment)));
+                                                      return connected;
+                                                  }, offsetMap.get(), &audio->second);
+
+                    writeChunk(sink, encoder, streamEvent(format, "done", "{\"done\": true}"));
+
+                } catch (const std::exception &e) {
+                    if (!connected) {
+                        return false;
+                    }
+                    writeChunk(sink, encoder,
+                               streamEvent(format, "error", errorJson("could not transcribe file", e.what())));
+
+                    std::cerr << "Exception occurred: " << e.what() << std::endl;
+                }
+                finishChunks(sink, encoder);
+                return true;
+            });
+}
+
 int main() {
 
     // Register the signal handler for SIGSEGV
@@ -51,9 +417,41 @@ int main() {
 
     TranscribeParams params = TranscribeParams();
 
-    const std::size_t poolSize = params.n_processors;
-    TranscriberPool pool = TranscriberPool(poolSize, params);
+    PolyphaseResampler::precomputeCommonBanks(COMMON_SAMPLE_RATE);
+
+    // every model is loaded and warmed in the background while the server already answers probes
+    std::unique_ptr<ModelRegistry> registry;
+    try {
+        registry = std::make_unique<ModelRegistry>(params);
+    } catch (const ModelRegistryException &e) {
+        std::cerr << "Invalid model configuration: " << e.what() << std::endl;
+        return 1;
+    }
+    ModelRegistry &models = *registry;
+
+    // jobs queue here per model instead of holding connection threads
+    std::vector<TranscriberPool *> jobPools;
+    for (const auto &model: models.all()) {
+        jobPools.push_back(model->pool.get());
+    }
+    JobQueue jobs(jobPools, (std::size_t) std::max(1, params.max_pending_jobs),
+                  (std::size_t) std::max(0, params.job_retention_count),
+                  std::chrono::seconds(std::max(0, params.job_retention_sec)));
+
+    VadStats vadStats;
+
+    ResultCache cache((std::size_t) std::max(0, params.cache_mb) * 1024 * 1024, params.cache_dir,
+                      (uint64_t) std::max(0, params.cache_dir_mb) * 1024 * 1024);
 
+    ResponseCompression compression(params.compression_min_bytes, params.compression_level);
+
+    ClipBatcher batcher(std::chrono::milliseconds(std::max(0, params.batch_max_delay_ms)),
+                        (std::size_t) std::max(0, params.batch_max_clip_ms) * COMMON_SAMPLE_RATE / 1000,
+                        (std::size_t) std::max(0, params.batch_guard_ms) * COMMON_SAMPLE_RATE / 1000);
+
+    // live sessions hold a worker each, finished ones are kept one idle timeout for late readers
+    RealtimeSessions realtime((std::size_t) std::max(0, params.max_realtime_sessions),
+                              std::chrono::milliseconds(std::max(0, params.realtime_idle_timeout_ms)));
 
 
     if (!svr.is_valid()) {
@@ -65,38 +463,269 @@ int main() {
         res.set_content("Say my name\n", "text/plain");
     });
 
+    // readiness probe, only succeeds once every worker finished its warm-up inference
+    svr.Get("/ready", [&models](const Request & /*req*/, Response &res) {
+        if (!models.ready()) {
+            res.status = 503;
+            res.set_content("{\"ready\":false}", "text/json");
+            return;
+        }
+        res.set_content("{\"ready\":true}", "text/json");
+    });
+
+    // Prometheus text format, so load balancers and scrapers can watch the queue
+    svr.Get("/metrics", [&models, &jobs, &realtime, &vadStats, &cache, &compression](const Request & /*req*/, Response &res) {
+        std::vector<std::pair<std::string, TranscriberPoolStats>> poolStats;
+        for (const auto &model: models.all()) {
+            poolStats.emplace_back("{model=\"" + model->name + "\"}", model->pool->stats());
+        }
+        JobQueueStats jobStats = jobs.stats();
+        ResultCacheStats cacheStats = cache.stats();
+        std::stringstream metrics;
+
+        // one series per model, the pools share the core budget so that is reported once
+        auto perModel = [&](const char *name, const char *type, const std::function<double(
+                const TranscriberPoolStats &)> &value) {
+            metrics << "# TYPE " << name << " " << type << "\n";
+            for (const auto &stats: poolStats) {
+                metrics << name << stats.first << " " << value(stats.second) << "\n";
+            }
+        };
+        perModel("transcriber_ready", "gauge", [](const TranscriberPoolStats &s) { return s.ready ? 1 : 0; });
+        perModel("transcriber_workers", "gauge", [](const TranscriberPoolStats &s) { return s.size; });
+        perModel("transcriber_workers_idle", "gauge", [](const TranscriberPoolStats &s) { return s.idle; });
+        perModel("transcriber_queue_depth", "gauge", [](const TranscriberPoolStats &s) { return s.waiting; });
+        perModel("transcriber_queue_max_depth", "gauge",
+                 [](const TranscriberPoolStats &s) { return s.max_queue_depth; });
+        perModel("transcriber_queue_wait_ms_total", "counter",
+                 [](const TranscriberPoolStats &s) { return s.wait_ms_total; });
+        perModel("transcriber_queue_wait_ms_max", "gauge",
+                 [](const TranscriberPoolStats &s) { return s.wait_ms_max; });
+        perModel("transcriber_service_ms_average", "gauge",
+                 [](const TranscriberPoolStats &s) { return s.service_ms_average; });
+        perModel("transcriber_requests_admitted_total", "counter",
+                 [](const TranscriberPoolStats &s) { return s.acquired; });
+
+        metrics << "# TYPE transcriber_requests_rejected_total counter\n";
+        for (const auto &stats: poolStats) {
+            const std::string model = stats.first.substr(1, stats.first.size() - 2);
+            metrics << "transcriber_requests_rejected_total{" << model << ",reason=\"queue_full\"} "
+                    << stats.second.rejected_queue_full << "\n"
+                    << "transcriber_requests_rejected_total{" << model << ",reason=\"queue_timeout\"} "
+                    << stats.second.rejected_queue_timeout << "\n";
+        }
+
+        // scheduling classes inside every pool
+        auto perClass = [&](const char *name, const char *type, const std::function<double(
+                const TranscriberClassStats &)> &value) {
+            metrics << "# TYPE " << name << " " << type << "\n";
+            for (const auto &stats: poolStats) {
+                const std::string model = stats.first.substr(1, stats.first.size() - 2);
+                for (std::size_t c = 0; c < TRANSCRIBE_PRIORITY_CLASSES; c++) {
+                    metrics << name << "{" << model << ",priority=\""
+                            << TranscriberPool::priorityName((TranscribePriority) c) << "\"} "
+                            << value(stats.second.classes[c]) << "\n";
+                }
+            }
+        };
+        perClass("transcriber_priority_queue_depth", "gauge",
+                 [](const TranscriberClassStats &s) { return s.waiting; });
+        perClass("transcriber_priority_admitted_total", "counter",
+                 [](const TranscriberClassStats &s) { return s.acquired; });
+        perClass("transcriber_priority_rejected_total", "counter",
+                 [](const TranscriberClassStats &s) { return s.rejected; });
+        perClass("transcriber_priority_wait_ms_total", "counter",
+                 [](const TranscriberClassStats &s) { return s.wait_ms_total; });
+        perClass("transcriber_priority_wait_ms_max", "gauge",
+                 [](const TranscriberClassStats &s) { return s.wait_ms_max; });
+
+        metrics << "# TYPE transcriber_thread_budget gauge\n"
+                << "transcriber_thread_budget " << poolStats.front().second.thread_budget << "\n"
+                << "# TYPE transcriber_threads_in_use gauge\n"
+                << "transcriber_threads_in_use " << poolStats.front().second.threads_in_use << "\n"
+                << "# TYPE transcriber_jobs gauge\n"
+                << "transcriber_jobs{status=\"queued\"} " << jobStats.pending << "\n"
+                << "transcriber_jobs{status=\"running\"} " << jobStats.running << "\n"
+                << "transcriber_jobs{status=\"finished\"} " << jobStats.retained << "\n"
+                << "# TYPE transcriber_jobs_submitted_total counter\n"
+                << "transcriber_jobs_submitted_total " << jobStats.submitted << "\n"
+                << "# TYPE transcriber_jobs_rejected_total counter\n"
+                << "transcriber_jobs_rejected_total " << jobStats.rejected << "\n"
+                << "# TYPE transcriber_realtime_sessions gauge\n"
+                << "transcriber_realtime_sessions " << realtime.active() << "\n"
+                << "# TYPE transcriber_vad_input_seconds_total counter\n"
+                << "transcriber_vad_input_seconds_total " << (double) vadStats.inputSamples / COMMON_SAMPLE_RATE << "\n"
+                << "# TYPE transcriber_vad_skipped_seconds_total counter\n"
+                << "transcriber_vad_skipped_seconds_total " << (double) vadStats.skippedSamples / COMMON_SAMPLE_RATE
+                << "\n"
+                << "# TYPE transcriber_cache_lookups_total counter\n"
+                << "transcriber_cache_lookups_total{result=\"memory_hit\"} " << cacheStats.memoryHits << "\n"
+                << "transcriber_cache_lookups_total{result=\"disk_hit\"} " << cacheStats.diskHits << "\n"
+                << "transcriber_cache_lookups_total{result=\"miss\"} " << cacheStats.misses << "\n"
+                << "# TYPE transcriber_cache_stores_total counter\n"
+                << "transcriber_cache_stores_total " << cacheStats.stores << "\n"
+                << "# TYPE transcriber_cache_evictions_total counter\n"
+                << "transcriber_cache_evictions_total " << cacheStats.evictions << "\n"
+                << "# TYPE transcriber_cache_entries gauge\n"
+                << "transcriber_cache_entries " << cacheStats.entries << "\n"
+                << "# TYPE transcriber_cache_bytes gauge\n"
+                << "transcriber_cache_bytes " << cacheStats.bytes << "\n"
+                << "# TYPE transcriber_cache_budget_bytes gauge\n"
+                << "transcriber_cache_budget_bytes " << cacheStats.budget << "\n"
+                << "# TYPE transcriber_cache_disk_evictions_total counter\n"
+                << "transcriber_cache_disk_evictions_total " << cacheStats.diskEvictions << "\n"
+                << "# TYPE transcriber_cache_disk_bytes gauge\n"
+                << "transcriber_cache_disk_bytes " << cacheStats.diskBytes << "\n"
+                << "# TYPE transcriber_cache_disk_budget_bytes gauge\n"
+                << "transcriber_cache_disk_budget_bytes " << cacheStats.diskBudget << "\n";
+
+        // time spent compressing against the bytes it saved
+        auto perEncoding = [&](const char *name, const std::function<double(const CompressionStats &)> &value) {
+            metrics << "# TYPE " << name << " counter\n";
+            for (ContentEncoding encoding: {ContentEncoding::Gzip, ContentEncoding::Zstd}) {
+                if (ResponseCompression::supported(encoding)) {
+                    metrics << name << "{encoding=\"" << ResponseCompression::name(encoding) << "\"} "
+                            << value(compression.stats(encoding)) << "\n";
+                }
+            }
+        };
+        perEncoding("transcriber_compression_responses_total",
+                    [](const CompressionStats &s) { return s.responses; });
+        perEncoding("transcriber_compression_input_bytes_total",
+                    [](const CompressionStats &s) { return s.bytesIn; });
+        perEncoding("transcriber_compression_output_bytes_total",
+                    [](const CompressionStats &s) { return s.bytesOut; });
+        perEncoding("transcriber_compression_seconds_total",
+                    [](const CompressionStats &s) { return s.ms / 1000; });
+        res.set_content(metrics.str(), "text/plain; version=0.0.4");
+    });
+
     svr.Get("/stop",
             [&](const Request & /*req*/, Response & /*res*/) { svr.stop(); });
 
-    svr.Post("/", [&pool, &params](const Request &req, Response &res) {
+    svr.Post("/", [&models, &params, &vadStats, &batcher, &cache, &compression](const Request &req, Response &res,
+                                                                 const ContentReader &content_reader) {
 
-        std::vector<float> pcmf32;               // mono-channel F32 PCM
-        std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
+        std::vector<float> pcmf32; // mono-channel F32 PCM
+        ChannelEnergy channels;    // left/right energies of a stereo upload for diarization
 
-        auto audioFile = req.get_file_value("audio_file");
-        std::string audioInputFile = xid::next().string().append("_" + audioFile.filename);
-        std::string audioOutputFile = AudioTooling::outputFileRename(audioInputFile);
+        if (!models.ready()) {
+            res.status = 503;
+            res.set_header("Retry-After", "1");
+            res.set_content("{\"error\":\"server busy\", \"reason\":\"transcription workers are warming up\"}",
+                            "text/json");
+            return;
+        }
+
+        // shed load before spending anything on reading the upload, when no model could take it anyway
+        TranscribePriority admissionPriority = requestedPriority(req, TranscribePriority::Standard);
+        if (models.isSaturated(admissionPriority)) {
+            models.countRejected(admissionPriority);
+            res.status = 429;
+            res.set_header("Retry-After", std::to_string(models.retryAfterSeconds()));
+            res.set_content("{\"error\":\"server busy\", \"reason\":\"transcription queue is full\"}", "text/json");
+            return;
+        }
+
+        OutputFormat outputFormat;
+        if (!requestedOutputFormat(req, outputFormat)) {
+            res.status = 406;
+            res.set_content("{\"error\":\"unsupported format\", \"reason\":\"format is one of json, json-min, ndjson, "
+                            "srt, vtt or binary\"}", "text/json");
+            return;
+        }
 
-        audioInputFile = Utils::getFilesStoragePath(audioInputFile);
-        audioOutputFile = Utils::getFilesStoragePath(audioOutputFile);
         try {
 
-            {
-                ofstream ofs(audioInputFile, ios::binary);
-                ofs << audioFile.content;
+            double uploadMs = 0;
+            double decodeMs = 0;
+            DecodeFields fields = requestedDecodeFields(req);
+            receiveAudio(req, content_reader, params, pcmf32, channels, fields, uploadMs, decodeMs);
+            TranscribeParams requestParams = DecodeProfiles::resolve(params, fields);
+            requestParams.output_format = outputFormat;
+            const char *contentType = TranscriptFormats::contentType(outputFormat);
+            TranscriberPool &pool = *models.route(requestParams, (double) pcmf32.size() / COMMON_SAMPLE_RATE).pool;
+            res.set_header("X-Model", requestParams.model_name);
+
+            StreamFormat format = requestedStreamFormat(req);
+
+            // a repeated upload is answered from the cache without touching a worker, streams always decode
+            CachePolicy cachePolicy = requestedCachePolicy(req);
+            std::string cacheKey;
+            if (format == StreamFormat::None && cache.enabled() && (cachePolicy.lookup || cachePolicy.store)) {
+                auto cacheStart = std::chrono::steady_clock::now();
+                cacheKey = ResultCache::key(pcmf32, channels, requestParams);
+                std::string cached;
+                if (cachePolicy.lookup && cache.lookup(cacheKey, cached)) {
+                    auto cacheEnd = std::chrono::steady_clock::now();
+                    res.set_header("X-Cache", "HIT");
+                    res.set_header("Server-Timing", "upload;dur=" + std::to_string(uploadMs) +
+                                                    ", decode;dur=" + std::to_string(decodeMs) + ", cache;dur=" +
+                                                    std::to_string(std::chrono::duration<double, std::milli>(
+                                                            cacheEnd - cacheStart).count()));
+                    setBody(req, res, compression, std::move(cached), contentType);
+                    return;
+                }
+                res.set_header("X-Cache", cachePolicy.lookup ? "MISS" : "BYPASS");
+            }
+
+            VadResult vad = removeSilence(requestParams, pcmf32, vadStats);
+
+            // short clips share one encoder window with the clips that arrive alongside them
+            if (format == StreamFormat::None && batcher.accepts(requestParams, pcmf32.size())) {
+                BatchOutcome batched = batcher.transcribe(pool, requestParams, pcmf32, channels, &vad.offsets);
+                res.set_header("Server-Timing", "upload;dur=" + std::to_string(uploadMs) +
+                                                ", decode;dur=" + std::to_string(decodeMs) + vadTiming(requestParams, vad) +
+                                                ", queue;dur=" + std::to_string(batched.waitMs) +
+                                                ", batch;desc=\"" + std::to_string(batched.clips) + " clips\"");
+                if (!cacheKey.empty() && cachePolicy.store) {
+                    cache.store(cacheKey, batched.body);
+                }
+                setBody(req, res, compression, std::move(batched.body), contentType);
+                return;
             }
 
+            auto worker = std::make_shared<WorkerLease>(
+                    pool, TranscriberPool::priorityOf(requestParams, TranscribePriority::Standard));
+            requestParams.n_threads = worker->threads();
+
+            // decode only reports the time left after the last byte arrived, the rest overlapped the upload
+            res.set_header("Server-Timing", "upload;dur=" + std::to_string(uploadMs) +
+                                            ", decode;dur=" + std::to_string(decodeMs) + vadTiming(requestParams, vad) +
+                                            ", queue;dur=" + std::to_string(worker->waitMs()));
+
+            if (format != StreamFormat::None) {
+                streamTranscription(res, format, worker, chunkEncoder(req, res, compression), requestParams,
+                                    std::move(pcmf32), std::move(channels), std::move(vad.offsets));
+                return;
+            }
 
-            AudioTooling::resampleAudioFile(audioInputFile, audioOutputFile);
+            // long recordings also use whatever workers are idle right now
+            std::string response = pool.transcribeSplit(*worker, requestParams, pcmf32, channels, &vad.offsets);
+            if (!cacheKey.empty() && cachePolicy.store) {
+                cache.store(cacheKey, response);
+            }
+            setBody(req, res, compression, std::move(response), contentType);
 
-            AudioTooling::preProcessWav(audioOutputFile, pcmf32, pcmf32s, false);
 
-            TranscribeWorker* worker = pool.acquire();
-            std::string response = worker->Transcribe(params, pcmf32, pcmf32s);
-            pool.release(worker);
+        } catch (const TranscriberPoolBusyException &e) {
+            std::string error_message = "{\"error\":\"server busy\", \"reason\":\"";
+            error_message = error_message.append(e.what()).append("\"}");
+            res.status = e.status();
+            res.set_header("Retry-After", std::to_string(e.retryAfterSeconds()));
+            res.set_content(error_message, "text/json");
 
-            res.set_content(response, "text/json");
+        } catch (const DecodeParamsException &e) {
+            std::string error_message = "{\"error\":\"invalid decoding parameters\", \"reason\":\"";
+            error_message = error_message.append(Utils::escapeDoubleQuotesAndBackslashes(e.what())).append("\"}");
+            res.status = 400;
+            res.set_content(error_message, "text/json");
 
+        } catch (const ModelRegistryException &e) {
+            std::string error_message = "{\"error\":\"invalid decoding parameters\", \"reason\":\"";
+            error_message = error_message.append(Utils::escapeDoubleQuotesAndBackslashes(e.what())).append("\"}");
+            res.status = 400;
+            res.set_content(error_message, "text/json");
 
         } catch (const ResamplingException &e) {
             std::string error_message = "{\"error\":\"could not transcribe file\", \"reason\":\"";
@@ -125,31 +754,298 @@ int main() {
             Utils::logStackTrace();
         }
 
-        if (std::remove(audioInputFile.c_str()) != 0) {
-            std::perror("Error deleting input file");
+    });
+
+    // asynchronous variant of POST /, answers with a job id as soon as the upload is decoded
+    svr.Post("/jobs", [&models, &jobs, &params, &vadStats](const Request &req, Response &res,
+                                                         const ContentReader &content_reader) {
+
+        if (!models.ready()) {
+            res.status = 503;
+            res.set_header("Retry-After", "1");
+            res.set_content("{\"error\":\"server busy\", \"reason\":\"transcription workers are warming up\"}",
+                            "text/json");
+            return;
         }
 
-        if (std::remove(audioOutputFile.c_str()) != 0) {
-            std::perror("Error deleting output file");
+        try {
+            std::vector<float> pcmf32;
+            ChannelEnergy channels;
+            double uploadMs = 0;
+            double decodeMs = 0;
+            DecodeFields fields = requestedDecodeFields(req);
+            receiveAudio(req, content_reader, params, pcmf32, channels, fields, uploadMs, decodeMs);
+            TranscribeParams jobParams = DecodeProfiles::resolve(params, fields);
+            TranscriberPool &pool = *models.route(jobParams, (double) pcmf32.size() / COMMON_SAMPLE_RATE).pool;
+            VadResult vad = removeSilence(jobParams, pcmf32, vadStats);
+
+            std::string id = jobs.submit(pool, jobParams, std::move(pcmf32), std::move(channels),
+                                         std::move(vad.offsets));
+
+            res.status = 202;
+            res.set_header("Location", "/jobs/" + id);
+            res.set_header("Server-Timing", "upload;dur=" + std::to_string(uploadMs) +
+                                            ", decode;dur=" + std::to_string(decodeMs) + vadTiming(jobParams, vad));
+            res.set_content("{\"id\":\"" + id + "\", \"status\":\"queued\"}", "text/json");
+
+        } catch (const JobQueueFullException &e) {
+            std::string error_message = "{\"error\":\"server busy\", \"reason\":\"";
+            error_message = error_message.append(e.what()).append("\"}");
+            res.status = 429;
+            res.set_header("Retry-After", std::to_string(models.retryAfterSeconds()));
+            res.set_content(error_message, "text/json");
+
+        } catch (const DecodeParamsException &e) {
+            std::string error_message = "{\"error\":\"invalid decoding parameters\", \"reason\":\"";
+            error_message = error_message.append(Utils::escapeDoubleQuotesAndBackslashes(e.what())).append("\"}");
+            res.status = 400;
+            res.set_content(error_message, "text/json");
+
+        } catch (const ModelRegistryException &e) {
+            std::string error_message = "{\"error\":\"invalid decoding parameters\", \"reason\":\"";
+            error_message = error_message.append(Utils::escapeDoubleQuotesAndBackslashes(e.what())).append("\"}");
+            res.status = 400;
+            res.set_content(error_message, "text/json");
+
+        } catch (const ResamplingException &e) {
+            std::string error_message = "{\"error\":\"could not decode file\", \"reason\":\"";
+            error_message = error_message.append(e.what()).append("\"}");
+            res.status = 400;
+            res.set_content(error_message, "text/json");
+
+        } catch (const std::exception &e) {
+            std::string error_message = "{\"error\":\"could not queue file\", \"reason\":\"";
+            error_message = error_message.append(e.what()).append("\"}");
+            res.status = 500;
+            res.set_content(error_message, "text/json");
+
+            std::cerr << "Exception occurred: " << e.what() << std::endl;
+            Utils::logStackTrace();
         }
+    });
+
+    svr.Get("/jobs/:id", [&jobs, &compression](const Request &req, Response &res) {
+        JobSnapshot job;
+        if (!jobs.lookup(req.path_params.at("id"), job)) {
+            res.status = 404;
+            res.set_content("{\"error\":\"job not found\"}", "text/json");
+            return;
+        }
+
+        std::string body;
+        body.reserve(64 + job.result.size() + job.error.size());
+        body.append("{\"id\":\"").append(job.id).append("\", \"status\":\"").append(JobQueue::statusName(job.status))
+                .append("\"");
+        if (job.status == JobStatus::Done) {
+            body.append(", \"result\":").append(job.result);
+        } else if (job.status == JobStatus::Failed) {
+            body.append(", \"error\":\"");
+            JsonWriter::escape(body, job.error.data(), job.error.size());
+            body.append("\"");
+        }
+        body.append("}");
+
+        res.set_header("Server-Timing", "queue;dur=" + std::to_string(job.queueMs) +
+                                        ", transcribe;dur=" + std::to_string(job.serviceMs));
+        setBody(req, res, compression, std::move(body));
+    });
+
+    // live transcription: open a session, stream s16le 16 kHz mono PCM into it (a single chunked POST or
+    // many small ones) while reading partial and final hypotheses from its event stream
+    svr.Post("/realtime", [&models, &realtime, &params](const Request &req, Response &res) {
+        if (!models.ready()) {
+            res.status = 503;
+            res.set_header("Retry-After", "1");
+            res.set_content("{\"error\":\"server busy\", \"reason\":\"transcription workers are warming up\"}",
+                            "text/json");
+            return;
+        }
+
+        try {
+            // the length of a live stream is unknown, only duration-free rules apply
+            TranscribeParams sessionParams = DecodeProfiles::resolve(params, requestedDecodeFields(req));
+            TranscriberPool &pool = *models.route(sessionParams, -1).pool;
+            std::shared_ptr<RealtimeSession> session = realtime.create(pool, sessionParams);
+            res.status = 201;
+            res.set_header("Location", "/realtime/" + session->id());
+            res.set_header("X-Model", sessionParams.model_name);
+            res.set_content("{\"id\":\"" + session->id() + "\", \"sample_rate\":" +
+                            std::to_string(COMMON_SAMPLE_RATE) + ", \"encoding\":\"s16le\"}", "text/json");
+
+        } catch (const DecodeParamsException &e) {
+            std::string error_message = "{\"error\":\"invalid decoding parameters\", \"reason\":\"";
+            error_message = error_message.append(Utils::escapeDoubleQuotesAndBackslashes(e.what())).append("\"}");
+            res.status = 400;
+            res.set_content(error_message, "text/json");
+
+        } catch (const ModelRegistryException &e) {
+            std::string error_message = "{\"error\":\"invalid decoding parameters\", \"reason\":\"";
+            error_message = error_message.append(Utils::escapeDoubleQuotesAndBackslashes(e.what())).append("\"}");
+            res.status = 400;
+            res.set_content(error_message, "text/json");
+
+        } catch (const RealtimeSessionLimitException &e) {
+            std::string error_message = "{\"error\":\"server busy\", \"reason\":\"";
+            error_message = error_message.append(e.what()).append("\"}");
+            res.status = 429;
+            res.set_header("Retry-After", std::to_string(models.retryAfterSeconds()));
+            res.set_content(error_message, "text/json");
 
+        } catch (const TranscriberPoolBusyException &e) {
+            std::string error_message = "{\"error\":\"server busy\", \"reason\":\"";
+            error_message = error_message.append(e.what()).append("\"}");
+            res.status = e.status();
+            res.set_header("Retry-After", std::to_string(e.retryAfterSeconds()));
+            res.set_content(error_message, "text/json");
+        }
     });
 
+    svr.Post("/realtime/:id/audio",
+             [&realtime](const Request &req, Response &res, const ContentReader &content_reader) {
+                 std::shared_ptr<RealtimeSession> session = realtime.find(req.path_params.at("id"));
+                 if (!session) {
+                     res.status = 404;
+                     res.set_content("{\"error\":\"session not found\"}", "text/json");
+                     return;
+                 }
 
-    svr.set_error_handler([](const Request & /*req*/, Response &res) {
+                 // samples reach the decoder as they arrive, a chunked upload can stay open for the whole session
+                 bool accepted = true;
+                 content_reader([&](const char *data, size_t data_length) {
+                     accepted = session->append(data, data_length);
+                     return accepted;
+                 });
+
+                 if (!accepted) {
+                     res.status = 409;
+                     res.set_content("{\"error\":\"session is not accepting audio\"}", "text/json");
+                     return;
+                 }
+                 res.status = 204;
+             });
+
+    svr.Get("/realtime/:id/events", [&realtime, &compression](const Request &req, Response &res) {
+        std::shared_ptr<RealtimeSession> session = realtime.find(req.path_params.at("id"));
+        if (!session) {
+            res.status = 404;
+            res.set_content("{\"error\":\"session not found\"}", "text/json");
+            return;
+        }
+
+        StreamFormat format = requestedStreamFormat(req);
+        if (format == StreamFormat::None) {
+            format = StreamFormat::EventStream;
+        }
+
+        uint64_t lastSequence = 0;
+        std::shared_ptr<CompressionStream> encoder = chunkEncoder(req, res, compression);
+        res.set_header("Cache-Control", "no-cache");
+        res.set_chunked_content_provider(
+                format == StreamFormat::EventStream ? "text/event-stream" : "application/x-ndjson",
+                [session, encoder, format, lastSequence](size_t /*offset*/, DataSink &sink) mutable {
+                    bool done = false;
+                    std::string error;
+                    std::vector<RealtimeEvent> events = session->events(lastSequence, std::chrono::seconds(15),
+                                                                         done, error);
+
+                    std::string chunk;
+                    for (const auto &event: events) {
+                        std::string json;
+                        JsonWriter(json, false)
+                                .beginObject()
+                                .string("type", event.final ? "final" : "partial")
+                                .beginObject("offsets")
+                                .number("from", event.from)
+                                .number("to", event.to)
+                                .endObject()
+                                .string("text", event.text)
+                                .endObject();
+                        chunk += streamEvent(format, event.final ? "final" : "partial", json);
+                        lastSequence = event.sequence;
+                    }
+
+                    if (done) {
+                        if (!error.empty()) {
+                            chunk += streamEvent(format, "error", errorJson("could not transcribe stream", error));
+                        } else {
+                            chunk += streamEvent(format, "done", "{\"done\": true}");
+                        }
+                    } else if (chunk.empty() && format == StreamFormat::EventStream) {
+                        // keeps proxies from closing an idle stream, and notices clients that went away
+                        chunk = ": keepalive\n\n";
+                    }
+
+                    if (!chunk.empty() && !writeChunk(sink, encoder, chunk)) {
+                        return false;
+                    }
+                    if (done) {
+                        finishChunks(sink, encoder);
+                    }
+                    return true;
+                });
+    });
+
+    svr.Delete("/realtime/:id", [&realtime](const Request &req, Response &res) {
+        std::shared_ptr<RealtimeSession> session = realtime.find(req.path_params.at("id"));
+        if (!session) {
+            res.status = 404;
+            res.set_content("{\"error\":\"session not found\"}", "text/json");
+            return;
+        }
+
+        // a session that already ended is dropped right away instead of waiting out its retention
+        if (session->finished()) {
+            realtime.remove(session->id());
+            res.set_content("{\"id\":\"" + session->id() + "\", \"status\":\"removed\"}", "text/json");
+            return;
+        }
+
+        // the decoder finalizes the remaining audio, the event stream ends after that final
+        session->close();
+        res.status = 202;
+        res.set_content("{\"id\":\"" + session->id() + "\", \"status\":\"closing\"}", "text/json");
+    });
+
+
+    svr.set_error_handler(Server::HandlerWithResponse([](const Request & /*req*/, Response &res) {
+        // leave the JSON bodies handlers set for their own error statuses alone
+        if (!res.body.empty()) {
+            return Server::HandlerResponse::Unhandled;
+        }
         const char *fmt = "<p>Error Status: <span style='color:red;'>%d</span></p>";
         char buf[BUFSIZ];
         snprintf(buf, sizeof(buf), fmt, res.status);
         res.set_content(buf, "text/html");
-    });
+        return Server::HandlerResponse::Handled;
+    }));
 
-    svr.set_payload_max_length(1024 * 1024 * 128);
+    svr.set_payload_max_length(MAX_UPLOAD_SIZE);
 
 
     int port_value = Utils::getEnvOrDefaultInt("PORT", 8080);
 
+    std::cout << "Audio kernels : " << AudioKernels::isa() << std::endl;
     std::cout << "Starting up server on port : " << port_value << std::endl;
+
+    // a model that cannot start takes the server down with it instead of answering 503 forever
+    int exitCode = 0;
+    std::atomic<bool> listening{true};
+    std::thread startupWatcher([&]() {
+        try {
+            models.waitUntilReady();
+        } catch (const TranscribeInitException &e) {
+            std::cerr << "Transcriber start-up failed: " << e.what() << std::endl;
+            exitCode = 1;
+            while (listening && !svr.is_running()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            svr.stop();
+        }
+    });
+
     svr.listen("0.0.0.0", port_value);
+    listening = false;
+    startupWatcher.join();
 
-    return 0;
+    return exitCode;
 }
\ No newline at end of file
@@ -0,0 +1,97 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "model_loader.h"
+#include "transcriber.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+MappedModelFile::MappedModelFile(const std::string &path, bool prefetch, bool lock) : path(path) {
+
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw TranscribeInitException("failed to open model file " + path + " : " + strerror(errno));
+    }
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        throw TranscribeInitException("failed to stat model file " + path);
+    }
+    size = (size_t) st.st_size;
+
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (prefetch) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+
+    data = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+    if (data == MAP_FAILED) {
+        data = nullptr;
+        ::close(fd);
+        throw TranscribeInitException("failed to map model file " + path + " : " + strerror(errno));
+    }
+
+    // the loader walks the file front to back exactly once
+    madvise(data, size, prefetch ? MADV_WILLNEED : MADV_SEQUENTIAL);
+
+    if (lock) {
+        isLocked = mlock(data, size) == 0;
+        if (!isLocked) {
+            std::cerr << "could not mlock model file " << path << " : " << strerror(errno)
+                      << " (check RLIMIT_MEMLOCK)" << std::endl;
+        }
+    }
+}
+
+MappedModelFile::~MappedModelFile() {
+    if (data != nullptr) {
+        if (isLocked) {
+            munlock(data, size);
+        }
+        munmap(data, size);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+whisper_context *MappedModelFile::load(bool withState) {
+    position = 0;
+
+    whisper_model_loader loader = {};
+    loader.context = this;
+    loader.read = &MappedModelFile::read;
+    loader.eof = &MappedModelFile::eof;
+    loader.close = &MappedModelFile::close;
+
+    return withState ? whisper_init(&loader) : whisper_init_no_state(&loader);
+}
+
+size_t MappedModelFile::read(void *ctx, void *output, size_t read_size) {
+    auto *file = static_cast<MappedModelFile *>(ctx);
+    size_t available = file->size - file->position;
+    size_t n = read_size < available ? read_size : available;
+    memcpy(output, static_cast<const char *>(file->data) + file->position, n);
+    file->position += n;
+    return n;
+}
+
+bool MappedModelFile::eof(void *ctx) {
+    auto *file = static_cast<MappedModelFile *>(ctx);
+    return file->position >= file->size;
+}
+
+void MappedModelFile::close(void * /*ctx*/) {
+    // the mapping outlives the loader, it is released by the destructor
+}
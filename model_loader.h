@@ -0,0 +1,49 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_MODEL_LOADER_H
+#define TRANSCRIBER_MODEL_LOADER_H
+
+#include <cstddef>
+#include <string>
+#include "whisper.h"
+
+
+// Read-only memory mapping of a ggml model file. Loading through the mapping reads straight from
+// the page cache, so every transcriber process on the host shares the same cached pages instead
+// of each streaming the file through its own read buffers.
+class MappedModelFile {
+public:
+    // prefetch asks the kernel to read the whole file ahead (MAP_POPULATE + MADV_WILLNEED),
+    // lock keeps the mapping resident with mlock so the cached pages survive memory pressure
+    MappedModelFile(const std::string &path, bool prefetch, bool lock);
+
+    ~MappedModelFile();
+
+    MappedModelFile(const MappedModelFile &) = delete;
+
+    MappedModelFile &operator=(const MappedModelFile &) = delete;
+
+    // Builds a whisper context from the mapped bytes, without a default state unless withState
+    whisper_context *load(bool withState = false);
+
+    [[nodiscard]] bool locked() const { return isLocked; }
+
+private:
+    static size_t read(void *ctx, void *output, size_t read_size);
+
+    static bool eof(void *ctx);
+
+    static void close(void *ctx);
+
+    std::string path;
+    int fd = -1;
+    void *data = nullptr;
+    size_t size = 0;
+    size_t position = 0;
+    bool isLocked = false;
+};
+
+
+#endif //TRANSCRIBER_MODEL_LOADER_H
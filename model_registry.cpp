@@ -0,0 +1,245 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "model_registry.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+
+namespace {
+
+    std::string trim(const std::string &value) {
+        const auto begin = value.find_first_not_of(" \t");
+        if (begin == std::string::npos) {
+            return "";
+        }
+        const auto end = value.find_last_not_of(" \t");
+        return value.substr(begin, end - begin + 1);
+    }
+
+    std::vector<std::string> split(const std::string &value, char separator) {
+        std::vector<std::string> parts;
+        std::size_t start = 0;
+        while (start <= value.size()) {
+            auto end = value.find(separator, start);
+            if (end == std::string::npos) {
+                end = value.size();
+            }
+            std::string part = trim(value.substr(start, end - start));
+            if (!part.empty()) {
+                parts.push_back(part);
+            }
+            start = end + 1;
+        }
+        return parts;
+    }
+
+    double parseSeconds(const std::string &rule, const std::string &value) {
+        char *end = nullptr;
+        double seconds = std::strtod(value.c_str(), &end);
+        if (value.empty() || *end != '\0' || seconds < 0) {
+            throw ModelRegistryException("invalid duration in route " + rule);
+        }
+        return seconds;
+    }
+
+}
+
+ModelRegistry::ModelRegistry(const TranscribeParams &params) {
+    struct Entry {
+        std::string name;
+        std::string path;
+        std::size_t workers;
+    };
+    std::vector<Entry> entries;
+
+    const auto defaultWorkers = (std::size_t) std::max(1, params.n_processors);
+    for (const auto &spec: split(params.models, ';')) {
+        auto equals = spec.find('=');
+        if (equals == std::string::npos || equals == 0) {
+            throw ModelRegistryException("model entry " + spec + " is not name=path[@workers]");
+        }
+        Entry entry{trim(spec.substr(0, equals)), trim(spec.substr(equals + 1)), defaultWorkers};
+
+        auto at = entry.path.rfind('@');
+        if (at != std::string::npos) {
+            std::string workers = entry.path.substr(at + 1);
+            char *end = nullptr;
+            long parsed = std::strtol(workers.c_str(), &end, 10);
+            if (workers.empty() || *end != '\0' || parsed < 1) {
+                throw ModelRegistryException("model entry " + spec + " has an invalid worker count");
+            }
+            entry.workers = (std::size_t) parsed;
+            entry.path = trim(entry.path.substr(0, at));
+        }
+
+        if (entry.path.empty()) {
+            throw ModelRegistryException("model entry " + spec + " has no path");
+        }
+        for (const auto &other: entries) {
+            if (other.name == entry.name) {
+                throw ModelRegistryException("model " + entry.name + " is listed twice");
+            }
+        }
+        entries.push_back(entry);
+    }
+
+    // a single model configured the way it always was
+    if (entries.empty()) {
+        entries.push_back({"default", params.model, defaultWorkers});
+    }
+
+    for (const auto &rule: split(params.model_routes, ';')) {
+        auto colon = rule.rfind(':');
+        if (colon == std::string::npos) {
+            throw ModelRegistryException("route " + rule + " is not conditions:model");
+        }
+        ModelRoute route;
+        route.model = trim(rule.substr(colon + 1));
+        if (std::none_of(entries.begin(), entries.end(), [&](const Entry &e) { return e.name == route.model; })) {
+            throw ModelRegistryException("route " + rule + " names an unknown model");
+        }
+
+        for (const auto &condition: split(rule.substr(0, colon), ',')) {
+            if (condition == "*") {
+                continue;
+            }
+            auto equals = condition.find('=');
+            std::string key = trim(condition.substr(0, equals));
+            std::string value = equals == std::string::npos ? "" : trim(condition.substr(equals + 1));
+            if (key == "profile") {
+                route.profile = value;
+            } else if (key == "language") {
+                route.language = value;
+            } else if (key == "min_sec") {
+                route.minSec = parseSeconds(rule, value);
+            } else if (key == "max_sec") {
+                route.maxSec = parseSeconds(rule, value);
+            } else {
+                throw ModelRegistryException("route " + rule + " has an unknown condition " + condition);
+            }
+        }
+        routes.push_back(route);
+    }
+
+    // one core budget for all pools, so models loaded side by side share the cores instead of each claiming them
+    std::size_t totalWorkers = 0;
+    for (const auto &entry: entries) {
+        totalWorkers += entry.workers;
+    }
+    budget = std::make_shared<ThreadBudget>(totalWorkers, params.thread_budget, params.thread_use_smt,
+                                            params.thread_pinning, params.n_threads);
+
+    for (const auto &entry: entries) {
+        TranscribeParams modelParams = params;
+        modelParams.model = entry.path;
+        modelParams.model_name = entry.name;
+
+        // the budget serves fewer workers than asked for when there are not enough cores, every model
+        // gets its share of them and keeps at least one
+        std::size_t workers = entry.workers;
+        if (totalWorkers > budget->workers()) {
+            workers = std::max<std::size_t>(1, entry.workers * budget->workers() / totalWorkers);
+            std::cerr << "model " << entry.name << " gets " << workers << " of " << entry.workers
+                      << " workers, the thread budget serves " << budget->workers() << std::endl;
+        }
+
+        auto model = std::make_unique<RegisteredModel>();
+        model->name = entry.name;
+        model->path = entry.path;
+        model->pool = std::make_unique<TranscriberPool>(workers, modelParams, budget);
+        models.push_back(std::move(model));
+    }
+}
+
+bool ModelRegistry::matches(const ModelRoute &route, const TranscribeParams &params, double durationSec) {
+    if (!route.profile.empty() && route.profile != params.profile) {
+        return false;
+    }
+    if (!route.language.empty()) {
+        // a detected language is only known after inference, such requests count as "auto"
+        const std::string language = params.detect_language ? "auto" : params.language;
+        if (route.language != language) {
+            return false;
+        }
+    }
+    if (route.minSec >= 0 && (durationSec < 0 || durationSec < route.minSec)) {
+        return false;
+    }
+    if (route.maxSec >= 0 && (durationSec < 0 || durationSec > route.maxSec)) {
+        return false;
+    }
+    return true;
+}
+
+RegisteredModel &ModelRegistry::route(TranscribeParams &params, double durationSec) {
+    RegisteredModel *chosen = nullptr;
+
+    if (!params.model_name.empty()) {
+        chosen = find(params.model_name);
+        if (!chosen) {
+            throw ModelRegistryException("model " + params.model_name + " is not served");
+        }
+    }
+
+    for (std::size_t i = 0; !chosen && i < routes.size(); i++) {
+        if (matches(routes[i], params, durationSec)) {
+            chosen = find(routes[i].model);
+        }
+    }
+
+    if (!chosen) {
+        chosen = models.front().get();
+    }
+
+    params.model = chosen->path;
+    params.model_name = chosen->name;
+    return *chosen;
+}
+
+bool ModelRegistry::ready() {
+    return std::all_of(models.begin(), models.end(), [](const std::unique_ptr<RegisteredModel> &model) {
+        return model->pool->ready();
+    });
+}
+
+void ModelRegistry::waitUntilReady() {
+    for (const auto &model: models) {
+        try {
+            model->pool->waitUntilReady();
+        } catch (const TranscribeInitException &e) {
+            throw TranscribeInitException("model " + model->name + ": " + e.what());
+        }
+    }
+}
+
+bool ModelRegistry::isSaturated(TranscribePriority priority) {
+    return std::all_of(models.begin(), models.end(), [priority](const std::unique_ptr<RegisteredModel> &model) {
+        return model->pool->isSaturated(priority);
+    });
+}
+
+void ModelRegistry::countRejected(TranscribePriority priority) {
+    models.front()->pool->countRejected(priority);
+}
+
+int ModelRegistry::retryAfterSeconds() {
+    int seconds = 0;
+    for (std::size_t i = 0; i < models.size(); i++) {
+        int modelSeconds = models[i]->pool->retryAfterSeconds();
+        seconds = i == 0 ? modelSeconds : std::min(seconds, modelSeconds);
+    }
+    return seconds;
+}
+
+RegisteredModel *ModelRegistry::find(const std::string &name) {
+    for (const auto &model: models) {
+        if (model->name == name) {
+            return model.get();
+        }
+    }
+    return nullptr;
+}
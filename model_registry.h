@@ -0,0 +1,85 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_MODEL_REGISTRY_H
+#define TRANSCRIBER_MODEL_REGISTRY_H
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "transcriber.h"
+#include "thread_budget.h"
+
+
+// A model served side by side with the others, with its own pool of workers
+struct RegisteredModel {
+    std::string name;
+    std::string path;
+    std::unique_ptr<TranscriberPool> pool;
+};
+
+// One routing rule, empty conditions match every request
+struct ModelRoute {
+    std::string profile;
+    std::string language;
+    // durations in seconds, negative when not constrained
+    double minSec = -1;
+    double maxSec = -1;
+    std::string model;
+};
+
+// The models named in ENV_MODELS, each loaded into its own TranscriberPool on one shared core budget,
+// and the ENV_MODEL_ROUTES rules that pick one of them per request. A request naming a model goes to
+// it directly; otherwise the first rule matching its profile, language and duration decides, and the
+// first model listed takes whatever no rule matched.
+class ModelRegistry {
+public:
+    // Throws ModelRegistryException when a model entry or a rule is malformed
+    explicit ModelRegistry(const TranscribeParams &params);
+
+    // Points params.model and params.model_name at the chosen model, a negative duration matches no duration
+    // rule. Throws ModelRegistryException when the request asked for a model that is not served.
+    RegisteredModel &route(TranscribeParams &params, double durationSec);
+
+    const std::vector<std::unique_ptr<RegisteredModel>> &all() const { return models; }
+
+    // True once every model's pool is ready
+    bool ready();
+
+    // Blocks until every pool started, throws TranscribeInitException for the first one that failed
+    void waitUntilReady();
+
+    // Every pool is saturated, nothing could be admitted whatever the routing decides
+    bool isSaturated(TranscribePriority priority);
+
+    // Counts one request turned away after isSaturated, against the first model like unrouted requests
+    void countRejected(TranscribePriority priority);
+
+    int retryAfterSeconds();
+
+private:
+    static bool matches(const ModelRoute &route, const TranscribeParams &params, double durationSec);
+
+    RegisteredModel *find(const std::string &name);
+
+    std::shared_ptr<ThreadBudget> budget;
+    std::vector<std::unique_ptr<RegisteredModel>> models;
+    std::vector<ModelRoute> routes;
+};
+
+class ModelRegistryException : public std::exception {
+public:
+    explicit ModelRegistryException(std::string message) : msg(std::move(message)) {}
+
+    [[nodiscard]] const char *what() const noexcept override {
+        return msg.c_str();
+    }
+
+private:
+    std::string msg;
+};
+
+
+#endif //TRANSCRIBER_MODEL_REGISTRY_H
@@ -0,0 +1,292 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "realtime_session.h"
+#include "audio_kernels.h"
+#include "audio_tooling.h"
+
+#include <algorithm>
+#include <cstring>
+#include <xid/xid.h>
+
+// audio a session buffers ahead of its decoder before appends are refused
+#define REALTIME_MAX_BACKLOG_SECONDS 120
+// events kept for readers that poll late
+#define REALTIME_MAX_EVENTS 256
+
+
+RealtimeSession::RealtimeSession(std::string id, TranscriberPool &pool, TranscribeParams params)
+        : sessionId(std::move(id)),
+          pool(pool),
+          params(std::move(params)),
+          stepSamples((std::size_t) std::max(1, this->params.realtime_step_ms) * COMMON_SAMPLE_RATE / 1000),
+          keepSamples((std::size_t) std::max(0, this->params.realtime_keep_ms) * COMMON_SAMPLE_RATE / 1000),
+          idleTimeout(std::max(1, this->params.realtime_idle_timeout_ms)) {
+
+    // a window always has room for at least one step after the kept tail
+    lengthSamples = std::max((std::size_t) std::max(1, this->params.realtime_length_ms) * COMMON_SAMPLE_RATE / 1000,
+                             keepSamples + stepSamples);
+
+    std::promise<void> leased;
+    std::future<void> ready = leased.get_future();
+    decoder = std::thread(&RealtimeSession::run, this, std::ref(leased));
+    try {
+        ready.get();
+    } catch (...) {
+        decoder.join();
+        throw;
+    }
+}
+
+RealtimeSession::~RealtimeSession() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        closed = true;
+    }
+    audioCv.notify_all();
+    decoder.join();
+}
+
+bool RealtimeSession::append(const char *data, size_t length) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (closed || incoming.size() > (std::size_t) REALTIME_MAX_BACKLOG_SECONDS * COMMON_SAMPLE_RATE) {
+        return false;
+    }
+
+    std::string bytes;
+    if (!partialSample.empty()) {
+        bytes = partialSample;
+        partialSample.clear();
+    }
+    bytes.append(data, length);
+
+    const std::size_t samples = bytes.size() / 2;
+    if (bytes.size() % 2 != 0) {
+        partialSample.assign(1, bytes.back());
+    }
+
+    // copied out so the kernels read aligned samples
+    std::vector<int16_t> pcm16(samples);
+    memcpy(pcm16.data(), bytes.data(), samples * sizeof(int16_t));
+
+    const std::size_t offset = incoming.size();
+    incoming.resize(offset + samples);
+    AudioKernels::monoToFloat(pcm16.data(), incoming.data() + offset, samples);
+
+    audioCv.notify_one();
+    return true;
+}
+
+void RealtimeSession::close() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        closed = true;
+    }
+    audioCv.notify_all();
+}
+
+bool RealtimeSession::finished() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return stopped;
+}
+
+std::chrono::milliseconds RealtimeSession::finishedFor() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!stopped) {
+        return std::chrono::milliseconds(0);
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - stoppedAt);
+}
+
+std::vector<RealtimeEvent> RealtimeSession::events(uint64_t after, std::chrono::milliseconds timeout, bool &done,
+                                                   std::string &error) {
+    std::unique_lock<std::mutex> lock(mutex);
+    eventCv.wait_for(lock, timeout, [&]() {
+        return stopped || (!published.empty() && published.back().sequence > after);
+    });
+
+    std::vector<RealtimeEvent> result;
+    for (const auto &event: published) {
+        if (event.sequence > after) {
+            result.push_back(event);
+        }
+    }
+    done = stopped;
+    error = failure;
+    return result;
+}
+
+void RealtimeSession::run(std::promise<void> &leased) {
+    // the lease pins the thread it is created on, so it lives on the decoder thread
+    std::unique_ptr<WorkerLease> worker;
+    try {
+        worker = std::make_unique<WorkerLease>(pool,
+                                               TranscriberPool::priorityOf(params, TranscribePriority::Interactive));
+    } catch (...) {
+        leased.set_exception(std::current_exception());
+        return;
+    }
+    leased.set_value();
+
+    TranscribeParams windowParams = params;
+    windowParams.n_threads = worker->threads();
+
+    std::vector<float> window;
+    std::vector<whisper_token> prompt;
+    int64_t windowStart = 0;
+    // the window holds audio no final covered yet
+    bool undecided = false;
+
+    try {
+        while (true) {
+            bool last;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                bool woken = audioCv.wait_for(lock, idleTimeout, [this]() {
+                    return closed || incoming.size() >= stepSamples;
+                });
+                if (!woken) {
+                    // the client stopped sending without closing, finalize what arrived
+                    closed = true;
+                }
+
+                // when decoding falls behind take at most one window, it is finalized without partials
+                std::size_t take = std::min(incoming.size(), lengthSamples - window.size());
+                window.insert(window.end(), incoming.begin(), incoming.begin() + (long) take);
+                incoming.erase(incoming.begin(), incoming.begin() + (long) take);
+                undecided = undecided || take > 0;
+                last = closed && incoming.empty();
+            }
+
+            if (undecided) {
+                bool final = last || window.size() >= lengthSamples;
+                std::string text = (*worker)->TranscribeWindow(windowParams, window, prompt, final);
+                publish(final, windowStart, windowStart + (int64_t) window.size(), std::move(text));
+
+                if (final) {
+                    std::size_t keep = std::min(keepSamples, window.size());
+                    windowStart += (int64_t) (window.size() - keep);
+                    window.erase(window.begin(), window.end() - (long) keep);
+                    undecided = false;
+                }
+            }
+
+            if (last) {
+                break;
+            }
+        }
+    } catch (const std::exception &e) {
+        std::unique_lock<std::mutex> lock(mutex);
+        failure = e.what();
+    }
+
+    worker.reset();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    closed = true;
+    stopped = true;
+    stoppedAt = std::chrono::steady_clock::now();
+    eventCv.notify_all();
+}
+
+void RealtimeSession::publish(bool final, int64_t fromSample, int64_t toSample, std::string text) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    RealtimeEvent event;
+    event.sequence = nextSequence++;
+    event.final = final;
+    event.from = fromSample * 1000 / COMMON_SAMPLE_RATE;
+    event.to = toSample * 1000 / COMMON_SAMPLE_RATE;
+    event.text = std::move(text);
+
+    published.push_back(std::move(event));
+    while (published.size() > REALTIME_MAX_EVENTS) {
+        published.pop_front();
+    }
+    eventCv.notify_all();
+}
+
+RealtimeSessions::RealtimeSessions(std::size_t maxSessions, std::chrono::milliseconds retention)
+        : maxSessions(maxSessions),
+          retention(retention) {
+}
+
+std::shared_ptr<RealtimeSession> RealtimeSessions::create(TranscriberPool &pool, const TranscribeParams &params) {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        reapLocked();
+
+        std::size_t running = creating;
+        for (const auto &session: sessions) {
+            running += session.second->finished() ? 0 : 1;
+        }
+        if (running >= maxSessions) {
+            throw RealtimeSessionLimitException("too many realtime sessions");
+        }
+        creating++;
+    }
+
+    // leasing the worker may wait for the pool, the registry stays available meanwhile
+    std::shared_ptr<RealtimeSession> session;
+    try {
+        session = std::make_shared<RealtimeSession>(xid::next().string(), pool, params);
+    } catch (...) {
+        std::unique_lock<std::mutex> lock(mutex);
+        creating--;
+        throw;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    creating--;
+    sessions[session->id()] = session;
+    return session;
+}
+
+std::shared_ptr<RealtimeSession> RealtimeSessions::find(const std::string &id) {
+    std::unique_lock<std::mutex> lock(mutex);
+    reapLocked();
+
+    auto found = sessions.find(id);
+    if (found == sessions.end()) {
+        return nullptr;
+    }
+    return found->second;
+}
+
+void RealtimeSessions::remove(const std::string &id) {
+    std::shared_ptr<RealtimeSession> session;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto found = sessions.find(id);
+        if (found == sessions.end()) {
+            return;
+        }
+        session = found->second;
+        sessions.erase(found);
+    }
+    // joining the decoder happens outside the registry lock
+    session.reset();
+}
+
+std::size_t RealtimeSessions::active() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    std::size_t running = 0;
+    for (const auto &session: sessions) {
+        running += session.second->finished() ? 0 : 1;
+    }
+    return running;
+}
+
+void RealtimeSessions::reapLocked() {
+    // finished sessions stay around for a while so readers can fetch the final events
+    for (auto it = sessions.begin(); it != sessions.end();) {
+        if (it->second->finished() && it->second->finishedFor() > retention) {
+            it = sessions.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,138 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_REALTIME_SESSION_H
+#define TRANSCRIBER_REALTIME_SESSION_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "transcriber.h"
+
+
+// A hypothesis for the current window. Partials are replaced by later ones for the same window,
+// a final closes the window. Offsets are in milliseconds from the start of the session.
+struct RealtimeEvent {
+    uint64_t sequence = 0;
+    bool final = false;
+    int64_t from = 0;
+    int64_t to = 0;
+    std::string text;
+};
+
+// Live transcription of continuous 16 kHz mono s16le PCM. A dedicated worker is leased for the
+// lifetime of the session and decodes a sliding window every step: the window grows until it reaches
+// the configured length, is finalized, and the next window starts from its last keep_ms of audio with
+// the final's tokens as prompt. Every sample is decoded a bounded number of times instead of once per
+// re-upload of a growing buffer.
+class RealtimeSession {
+public:
+    // Blocks until a worker is leased, throws TranscriberPoolBusyException when none becomes free
+    RealtimeSession(std::string id, TranscriberPool &pool, TranscribeParams params);
+
+    ~RealtimeSession();
+
+    RealtimeSession(const RealtimeSession &) = delete;
+
+    RealtimeSession &operator=(const RealtimeSession &) = delete;
+
+    [[nodiscard]] const std::string &id() const { return sessionId; }
+
+    // Appends raw s16le samples, returns false once the session no longer accepts audio
+    bool append(const char *data, size_t length);
+
+    // No more audio: the remaining window is finalized and the session ends
+    void close();
+
+    bool finished();
+
+    // Time since the decoder stopped, zero while it still runs
+    std::chrono::milliseconds finishedFor();
+
+    // Waits up to timeout for events after the given sequence number. done is set once the session
+    // ended and every event was returned, error carries the reason when it ended abnormally.
+    std::vector<RealtimeEvent> events(uint64_t after, std::chrono::milliseconds timeout, bool &done,
+                                      std::string &error);
+
+private:
+    void run(std::promise<void> &leased);
+
+    void publish(bool final, int64_t fromSample, int64_t toSample, std::string text);
+
+    std::string sessionId;
+    TranscriberPool &pool;
+    TranscribeParams params;
+    std::size_t stepSamples;
+    std::size_t lengthSamples;
+    std::size_t keepSamples;
+    std::chrono::milliseconds idleTimeout;
+
+    std::vector<float> incoming;
+    // odd byte of a sample split across two appends
+    std::string partialSample;
+    bool closed = false;
+    bool stopped = false;
+    std::string failure;
+    std::chrono::steady_clock::time_point stoppedAt;
+
+    std::deque<RealtimeEvent> published;
+    uint64_t nextSequence = 1;
+
+    std::mutex mutex;
+    std::condition_variable audioCv;
+    std::condition_variable eventCv;
+    std::thread decoder;
+};
+
+// Owns the live sessions, caps how many workers they may hold and drops sessions that ended a while ago
+class RealtimeSessions {
+public:
+    RealtimeSessions(std::size_t maxSessions, std::chrono::milliseconds retention);
+
+    // Throws RealtimeSessionLimitException or TranscriberPoolBusyException
+    std::shared_ptr<RealtimeSession> create(TranscriberPool &pool, const TranscribeParams &params);
+
+    // Null when the id is unknown or the session was already dropped
+    std::shared_ptr<RealtimeSession> find(const std::string &id);
+
+    // Drops a session before its retention ran out
+    void remove(const std::string &id);
+
+    std::size_t active();
+
+private:
+    void reapLocked();
+
+    std::size_t maxSessions;
+    std::chrono::milliseconds retention;
+    // sessions still waiting for their worker, they count against maxSessions
+    std::size_t creating = 0;
+
+    std::unordered_map<std::string, std::shared_ptr<RealtimeSession>> sessions;
+    std::mutex mutex;
+};
+
+class RealtimeSessionLimitException : public std::exception {
+public:
+    explicit RealtimeSessionLimitException(std::string message) : msg(std::move(message)) {}
+
+    [[nodiscard]] const char *what() const noexcept override {
+        return msg.c_str();
+    }
+
+private:
+    std::string msg;
+};
+
+
+#endif //TRANSCRIBER_REALTIME_SESSION_H
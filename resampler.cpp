@@ -0,0 +1,169 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "resampler.h"
+#include "audio_kernels.h"
+#include "audio_tooling.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <utility>
+
+#define RESAMPLER_BASE_TAPS 32
+#define RESAMPLER_MAX_PHASES 1024
+#define RESAMPLER_MAX_DECIMATION 16
+#define RESAMPLER_ROLLOFF 0.92
+#define RESAMPLER_KAISER_BETA 8.6
+
+
+namespace {
+
+    double besselI0(double x) {
+        double sum = 1.0;
+        double term = 1.0;
+        for (int k = 1; k < 64; k++) {
+            double factor = x / (2.0 * k);
+            term *= factor * factor;
+            sum += term;
+            if (term < 1e-12 * sum) {
+                break;
+            }
+        }
+        return sum;
+    }
+
+    std::pair<uint32_t, uint32_t> reduceRatio(uint32_t inputRate, uint32_t outputRate) {
+        uint32_t divisor = std::gcd(inputRate, outputRate);
+        return {outputRate / divisor, inputRate / divisor};
+    }
+
+    std::shared_ptr<const PolyphaseFilterBank> designBank(uint32_t up, uint32_t down) {
+        const uint32_t maxFactor = std::max(up, down);
+
+        // the prototype spans RESAMPLER_BASE_TAPS samples at the lower of the two rates,
+        // rounded up to a multiple of 8 so every phase is a whole number of SIMD lanes
+        auto taps = (uint32_t) std::ceil((double) RESAMPLER_BASE_TAPS * maxFactor / up);
+        taps = (taps + 7) / 8 * 8;
+
+        const size_t length = (size_t) up * taps;
+        const double cutoff = RESAMPLER_ROLLOFF / maxFactor;
+        // centred on an integer tap so the group delay is a whole number of upsampled samples
+        const double center = (double) (length / 2);
+        const double windowNorm = besselI0(RESAMPLER_KAISER_BETA);
+
+        std::vector<double> prototype(length);
+        double sum = 0.0;
+        for (size_t n = 0; n < length; n++) {
+            const double x = (double) n - center;
+            const double arg = M_PI * cutoff * x;
+            const double sinc = x == 0.0 ? 1.0 : std::sin(arg) / arg;
+            const double r = 2.0 * x / (double) length;
+            const double window = besselI0(RESAMPLER_KAISER_BETA * std::sqrt(std::max(0.0, 1.0 - r * r))) / windowNorm;
+            prototype[n] = cutoff * sinc * window;
+            sum += prototype[n];
+        }
+
+        // unity passband gain once the zero-stuffed input is folded back in
+        const double gain = (double) up / sum;
+
+        auto bank = std::make_shared<PolyphaseFilterBank>();
+        bank->upFactor = up;
+        bank->downFactor = down;
+        bank->tapsPerPhase = taps;
+        bank->coefficients.resize(length);
+        for (uint32_t p = 0; p < up; p++) {
+            for (uint32_t j = 0; j < taps; j++) {
+                bank->coefficients[(size_t) p * taps + (taps - 1 - j)] = (float) (prototype[p + (size_t) j * up] * gain);
+            }
+        }
+        return bank;
+    }
+
+    std::shared_ptr<const PolyphaseFilterBank> getBank(uint32_t inputRate, uint32_t outputRate) {
+        static std::mutex mutex;
+        static std::map<std::pair<uint32_t, uint32_t>, std::shared_ptr<const PolyphaseFilterBank>> banks;
+
+        const auto ratio = reduceRatio(inputRate, outputRate);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        auto &bank = banks[ratio];
+        if (!bank) {
+            bank = designBank(ratio.first, ratio.second);
+        }
+        return bank;
+    }
+
+}
+
+PolyphaseResampler::PolyphaseResampler(uint32_t inputRate, uint32_t outputRate) {
+    if (!supports(inputRate, outputRate)) {
+        throw ResamplingException("unsupported resampling ratio " + std::to_string(inputRate) + " -> " +
+                                  std::to_string(outputRate));
+    }
+
+    bank = getBank(inputRate, outputRate);
+
+    // history starts with T - 1 zeros so the first outputs see silence before the signal
+    history.assign(bank->tapsPerPhase - 1, 0.0f);
+    delay = ((uint64_t) bank->upFactor * bank->tapsPerPhase) / 2;
+}
+
+void PolyphaseResampler::process(const float *input, size_t n, std::vector<float> &output) {
+    history.insert(history.end(), input, input + n);
+    received += n;
+    produce(output, UINT64_MAX);
+}
+
+void PolyphaseResampler::flush(std::vector<float> &output) {
+    const uint64_t total = (received * bank->upFactor + bank->downFactor - 1) / bank->downFactor;
+
+    // enough trailing zeros for the filter to settle past the last input sample
+    history.insert(history.end(), bank->tapsPerPhase, 0.0f);
+    produce(output, total);
+}
+
+void PolyphaseResampler::produce(std::vector<float> &output, uint64_t limit) {
+    const uint32_t up = bank->upFactor;
+    const uint32_t down = bank->downFactor;
+    const uint32_t taps = bank->tapsPerPhase;
+    const uint64_t available = consumed + history.size();
+
+    while (produced < limit) {
+        const uint64_t t = produced * down + delay;
+        const uint64_t base = t / up;
+        if (base + taps > available) {
+            break;
+        }
+        const auto phase = (uint32_t) (t % up);
+        output.push_back(AudioKernels::dot(bank->phase(phase), history.data() + (base - consumed), taps));
+        produced++;
+    }
+
+    // drop the input no later output can reach
+    const uint64_t nextBase = (produced * down + delay) / up;
+    if (nextBase > consumed) {
+        const auto drop = (size_t) std::min<uint64_t>(nextBase - consumed, history.size());
+        history.erase(history.begin(), history.begin() + (std::ptrdiff_t) drop);
+        consumed += drop;
+    }
+}
+
+bool PolyphaseResampler::supports(uint32_t inputRate, uint32_t outputRate) {
+    if (inputRate == 0 || outputRate == 0) {
+        return false;
+    }
+    const auto ratio = reduceRatio(inputRate, outputRate);
+    return ratio.first <= RESAMPLER_MAX_PHASES && ratio.second <= ratio.first * RESAMPLER_MAX_DECIMATION;
+}
+
+void PolyphaseResampler::precomputeCommonBanks(uint32_t outputRate) {
+    for (uint32_t rate: {8000u, 11025u, 22050u, 24000u, 32000u, 44100u, 48000u}) {
+        if (rate != outputRate) {
+            getBank(rate, outputRate);
+        }
+    }
+}
@@ -0,0 +1,56 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_RESAMPLER_H
+#define TRANSCRIBER_RESAMPLER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+// Kaiser-windowed sinc prototype split into L phases for an L/M rate change.
+// Each phase is stored reversed so an output sample is one contiguous dot product.
+struct PolyphaseFilterBank {
+    uint32_t upFactor;      // L
+    uint32_t downFactor;    // M
+    uint32_t tapsPerPhase;  // T
+    std::vector<float> coefficients; // L * T
+
+    [[nodiscard]] const float *phase(uint32_t p) const { return coefficients.data() + (size_t) p * tapsPerPhase; }
+};
+
+
+// Streaming polyphase resampler. Input can be pushed in blocks of any size, state is carried
+// between calls, and flush() emits the tail held back by the filter delay.
+class PolyphaseResampler {
+
+public:
+    PolyphaseResampler(uint32_t inputRate, uint32_t outputRate);
+
+    void process(const float *input, size_t n, std::vector<float> &output);
+
+    void flush(std::vector<float> &output);
+
+    // True if the rate pair reduces to a ratio small enough for a precomputed bank
+    static bool supports(uint32_t inputRate, uint32_t outputRate);
+
+    // Builds the banks for the rates browsers, telephony and media files commonly use,
+    // so the first request at each rate does not pay for the filter design
+    static void precomputeCommonBanks(uint32_t outputRate);
+
+private:
+    void produce(std::vector<float> &output, uint64_t limit);
+
+    std::shared_ptr<const PolyphaseFilterBank> bank;
+    std::vector<float> history;
+    uint64_t consumed = 0;   // input samples dropped from the front of history
+    uint64_t received = 0;   // input samples pushed so far
+    uint64_t produced = 0;   // output samples emitted so far
+    uint64_t delay;          // filter group delay in upsampled samples
+};
+
+
+#endif //TRANSCRIBER_RESAMPLER_H
@@ -0,0 +1,250 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "response_compression.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+
+namespace {
+
+    std::string trim(const std::string &value) {
+        const auto begin = value.find_first_not_of(" \t");
+        if (begin == std::string::npos) {
+            return "";
+        }
+        const auto end = value.find_last_not_of(" \t");
+        return value.substr(begin, end - begin + 1);
+    }
+
+    // room for the codec to write into, grown again while it reports a full buffer
+    std::size_t chunkFor(std::size_t length) {
+        return std::max<std::size_t>(16384, length / 2);
+    }
+
+}
+
+CompressionStream::CompressionStream(ResponseCompression &owner, ContentEncoding encoding, int level)
+        : owner(owner),
+          contentEncoding(encoding) {
+    if (encoding == ContentEncoding::Gzip) {
+        // 15 window bits plus 16 writes a gzip header and trailer instead of a zlib one
+        if (deflateInit2(&zlib, level > 0 ? std::min(level, 9) : Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw CompressionException("could not initialize gzip");
+        }
+    }
+#ifdef TRANSCRIBER_ZSTD
+    else if (encoding == ContentEncoding::Zstd) {
+        zstd = ZSTD_createCCtx();
+        if (!zstd) {
+            throw CompressionException("could not initialize zstd");
+        }
+        ZSTD_CCtx_setParameter(zstd, ZSTD_c_compressionLevel,
+                               level > 0 ? std::min(level, ZSTD_maxCLevel()) : ZSTD_CLEVEL_DEFAULT);
+    }
+#endif
+    else {
+        throw CompressionException(std::string(ResponseCompression::name(encoding)) + " is not supported");
+    }
+    totals.responses = 1;
+}
+
+CompressionStream::~CompressionStream() {
+    if (contentEncoding == ContentEncoding::Gzip) {
+        deflateEnd(&zlib);
+    }
+#ifdef TRANSCRIBER_ZSTD
+    ZSTD_freeCCtx(zstd);
+#endif
+    // a stream cut short by its client still spent the time
+    owner.record(contentEncoding, totals);
+}
+
+void CompressionStream::write(const char *data, std::size_t length, std::string &out) {
+    run(data, length, false, out);
+}
+
+void CompressionStream::finish(std::string &out) {
+    if (!finished) {
+        run(nullptr, 0, true, out);
+        finished = true;
+    }
+}
+
+void CompressionStream::run(const char *data, std::size_t length, bool last, std::string &out) {
+    if (finished) {
+        throw CompressionException("write after the end of a compressed stream");
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    const std::size_t before = out.size();
+    const std::size_t chunk = chunkFor(length);
+
+    if (contentEncoding == ContentEncoding::Gzip) {
+        zlib.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        zlib.avail_in = (uInt) length;
+        // a sync flush ends on a byte boundary, everything written so far can be decoded
+        const int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+        do {
+            const std::size_t used = out.size();
+            out.resize(used + chunk);
+            zlib.next_out = reinterpret_cast<Bytef *>(&out[used]);
+            zlib.avail_out = (uInt) chunk;
+            const int rc = deflate(&zlib, flush);
+            out.resize(used + chunk - zlib.avail_out);
+            if (rc == Z_STREAM_ERROR) {
+                throw CompressionException("gzip stream is corrupt");
+            }
+        } while (zlib.avail_out == 0);
+    }
+#ifdef TRANSCRIBER_ZSTD
+    else if (contentEncoding == ContentEncoding::Zstd) {
+        ZSTD_inBuffer input{data, length, 0};
+        const ZSTD_EndDirective mode = last ? ZSTD_e_end : ZSTD_e_flush;
+        std::size_t remaining;
+        do {
+            const std::size_t used = out.size();
+            out.resize(used + chunk);
+            ZSTD_outBuffer output{&out[used], chunk, 0};
+            remaining = ZSTD_compressStream2(zstd, &output, &input, mode);
+            out.resize(used + output.pos);
+            if (ZSTD_isError(remaining)) {
+                throw CompressionException(std::string("zstd failed: ") + ZSTD_getErrorName(remaining));
+            }
+        } while (remaining != 0);
+    }
+#endif
+
+    totals.bytesIn += length;
+    totals.bytesOut += out.size() - before;
+    totals.ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+ResponseCompression::ResponseCompression(int minBytes, int level)
+        : minBytes(minBytes),
+          level(level) {
+}
+
+bool ResponseCompression::supported(ContentEncoding encoding) {
+    switch (encoding) {
+        case ContentEncoding::Identity:
+        case ContentEncoding::Gzip:
+            return true;
+        case ContentEncoding::Zstd:
+#ifdef TRANSCRIBER_ZSTD
+            return true;
+#else
+            return false;
+#endif
+    }
+    return false;
+}
+
+const char *ResponseCompression::name(ContentEncoding encoding) {
+    switch (encoding) {
+        case ContentEncoding::Identity:
+            return "identity";
+        case ContentEncoding::Gzip:
+            return "gzip";
+        case ContentEncoding::Zstd:
+            return "zstd";
+    }
+    return "identity";
+}
+
+ContentEncoding ResponseCompression::negotiate(const std::string &acceptEncoding) const {
+    if (minBytes < 0 || acceptEncoding.empty()) {
+        return ContentEncoding::Identity;
+    }
+
+    // q values of gzip and zstd, a wildcard covers whichever is not listed by name
+    double quality[CONTENT_ENCODINGS] = {0, -1, -1};
+    double wildcard = -1;
+    std::size_t start = 0;
+    while (start <= acceptEncoding.size()) {
+        auto end = acceptEncoding.find(',', start);
+        if (end == std::string::npos) {
+            end = acceptEncoding.size();
+        }
+        std::string coding = trim(acceptEncoding.substr(start, end - start));
+        start = end + 1;
+
+        double q = 1;
+        auto semicolon = coding.find(';');
+        if (semicolon != std::string::npos) {
+            std::string parameter = trim(coding.substr(semicolon + 1));
+            if (parameter.rfind("q=", 0) == 0) {
+                q = std::strtod(parameter.c_str() + 2, nullptr);
+            }
+            coding = trim(coding.substr(0, semicolon));
+        }
+
+        if (coding == "gzip" || coding == "x-gzip") {
+            quality[(int) ContentEncoding::Gzip] = q;
+        } else if (coding == "zstd") {
+            quality[(int) ContentEncoding::Zstd] = q;
+        } else if (coding == "*") {
+            wildcard = q;
+        }
+    }
+
+    ContentEncoding best = ContentEncoding::Identity;
+    double bestQuality = 0;
+    for (ContentEncoding encoding: {ContentEncoding::Zstd, ContentEncoding::Gzip}) {
+        double q = quality[(int) encoding] < 0 ? wildcard : quality[(int) encoding];
+        if (supported(encoding) && q > bestQuality) {
+            best = encoding;
+            bestQuality = q;
+        }
+    }
+    return best;
+}
+
+ContentEncoding ResponseCompression::compress(const std::string &acceptEncoding, std::string &body) {
+    if (minBytes < 0 || body.size() < (std::size_t) minBytes) {
+        return ContentEncoding::Identity;
+    }
+    ContentEncoding encoding = negotiate(acceptEncoding);
+    if (encoding == ContentEncoding::Identity) {
+        return encoding;
+    }
+
+    std::string compressed;
+    compressed.reserve(body.size() / 4 + 64);
+    {
+        CompressionStream stream(*this, encoding, level);
+        stream.write(body.data(), body.size(), compressed);
+        stream.finish(compressed);
+    }
+    if (compressed.size() >= body.size()) {
+        return ContentEncoding::Identity;
+    }
+    body.swap(compressed);
+    return encoding;
+}
+
+std::shared_ptr<CompressionStream> ResponseCompression::stream(const std::string &acceptEncoding) {
+    ContentEncoding encoding = negotiate(acceptEncoding);
+    if (encoding == ContentEncoding::Identity) {
+        return nullptr;
+    }
+    return std::make_shared<CompressionStream>(*this, encoding, level);
+}
+
+CompressionStats ResponseCompression::stats(ContentEncoding encoding) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return totals[(int) encoding];
+}
+
+void ResponseCompression::record(ContentEncoding encoding, const CompressionStats &response) {
+    std::lock_guard<std::mutex> lock(mutex);
+    CompressionStats &total = totals[(int) encoding];
+    total.responses += response.responses;
+    total.bytesIn += response.bytesIn;
+    total.bytesOut += response.bytesOut;
+    total.ms += response.ms;
+}
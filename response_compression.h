@@ -0,0 +1,118 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_RESPONSE_COMPRESSION_H
+#define TRANSCRIBER_RESPONSE_COMPRESSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <zlib.h>
+
+#ifdef TRANSCRIBER_ZSTD
+#include <zstd.h>
+#endif
+
+#define CONTENT_ENCODINGS 3
+
+
+enum class ContentEncoding {
+    Identity = 0,
+    Gzip = 1,
+    Zstd = 2
+};
+
+struct CompressionStats {
+    uint64_t responses = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    double ms = 0;
+};
+
+class ResponseCompression;
+
+// One response body compressed piece by piece. Every write is flushed, so a client can decode each
+// streamed event as soon as it arrives instead of waiting for the codec to fill a block.
+class CompressionStream {
+public:
+    CompressionStream(ResponseCompression &owner, ContentEncoding encoding, int level);
+
+    ~CompressionStream();
+
+    CompressionStream(const CompressionStream &) = delete;
+
+    CompressionStream &operator=(const CompressionStream &) = delete;
+
+    [[nodiscard]] ContentEncoding encoding() const { return contentEncoding; }
+
+    // Appends data compressed and flushed to out
+    void write(const char *data, std::size_t length, std::string &out);
+
+    // Appends the end of the stream to out, nothing can be written afterwards
+    void finish(std::string &out);
+
+private:
+    void run(const char *data, std::size_t length, bool last, std::string &out);
+
+    ResponseCompression &owner;
+    ContentEncoding contentEncoding;
+    z_stream zlib{};
+#ifdef TRANSCRIBER_ZSTD
+    ZSTD_CCtx *zstd = nullptr;
+#endif
+    bool finished = false;
+    CompressionStats totals;
+};
+
+// Accept-Encoding negotiation and the compression counters behind /metrics. gzip is always available,
+// zstd when the server was built against libzstd.
+class ResponseCompression {
+public:
+    // bodies below minBytes are sent as they are, a negative minBytes disables compression
+    ResponseCompression(int minBytes, int level);
+
+    static bool supported(ContentEncoding encoding);
+
+    static const char *name(ContentEncoding encoding);
+
+    // The supported encoding with the highest q value in acceptEncoding, zstd before gzip on a tie
+    ContentEncoding negotiate(const std::string &acceptEncoding) const;
+
+    // Compresses body in place when it is large enough, it shrinks and the client accepts an encoding.
+    // Returns the encoding of body afterwards.
+    ContentEncoding compress(const std::string &acceptEncoding, std::string &body);
+
+    // Encoder for a response of unknown length, the size threshold does not apply. Null for identity.
+    std::shared_ptr<CompressionStream> stream(const std::string &acceptEncoding);
+
+    CompressionStats stats(ContentEncoding encoding);
+
+private:
+    friend class CompressionStream;
+
+    void record(ContentEncoding encoding, const CompressionStats &response);
+
+    int minBytes;
+    int level;
+
+    std::mutex mutex;
+    CompressionStats totals[CONTENT_ENCODINGS];
+};
+
+class CompressionException : public std::exception {
+public:
+    explicit CompressionException(std::string message) : msg(std::move(message)) {}
+
+    [[nodiscard]] const char *what() const noexcept override {
+        return msg.c_str();
+    }
+
+private:
+    std::string msg;
+};
+
+
+#endif //TRANSCRIBER_RESPONSE_COMPRESSION_H
@@ -0,0 +1,311 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "result_cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// a temporary this old was left by a writer that died before its rename, a live write takes milliseconds
+#define RESULT_CACHE_STALE_TEMPORARY_SEC 600
+
+
+namespace {
+
+    inline uint64_t rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    inline uint64_t fmix(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    }
+
+    // MurmurHash3 x64 128, fast enough that hashing an upload costs far less than decoding it
+    void hash128(const void *data, std::size_t length, uint64_t seed, uint64_t &h1, uint64_t &h2) {
+        const auto *bytes = static_cast<const uint8_t *>(data);
+        const uint64_t c1 = 0x87c37b91114253d5ULL;
+        const uint64_t c2 = 0x4cf5ad432745937fULL;
+        const std::size_t blocks = length / 16;
+
+        h1 = seed;
+        h2 = seed;
+
+        for (std::size_t i = 0; i < blocks; i++) {
+            uint64_t k1;
+            uint64_t k2;
+            memcpy(&k1, bytes + i * 16, 8);
+            memcpy(&k2, bytes + i * 16 + 8, 8);
+
+            k1 *= c1;
+            k1 = rotl(k1, 31);
+            k1 *= c2;
+            h1 ^= k1;
+            h1 = rotl(h1, 27);
+            h1 += h2;
+            h1 = h1 * 5 + 0x52dce729;
+
+            k2 *= c2;
+            k2 = rotl(k2, 33);
+            k2 *= c1;
+            h2 ^= k2;
+            h2 = rotl(h2, 31);
+            h2 += h1;
+            h2 = h2 * 5 + 0x38495ab5;
+        }
+
+        uint8_t tail[16] = {0};
+        memcpy(tail, bytes + blocks * 16, length & 15);
+        uint64_t k1;
+        uint64_t k2;
+        memcpy(&k1, tail, 8);
+        memcpy(&k2, tail + 8, 8);
+        k2 *= c2;
+        k2 = rotl(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        k1 *= c1;
+        k1 = rotl(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+
+        h1 ^= length;
+        h2 ^= length;
+        h1 += h2;
+        h2 += h1;
+        h1 = fmix(h1);
+        h2 = fmix(h2);
+        h1 += h2;
+        h2 += h1;
+    }
+
+}
+
+ResultCache::ResultCache(std::size_t budget, std::string directory, uint64_t directoryBudget)
+        : budget(budget),
+          directory(std::move(directory)),
+          directoryBudget(directoryBudget) {
+    if (!this->directory.empty()) {
+        trimDirectory();
+    }
+}
+
+std::string ResultCache::key(const std::vector<float> &pcmf32, const ChannelEnergy &channels,
+                             const TranscribeParams &params) {
+    // everything that changes the rendered output, thread counts and pool settings do not
+    std::stringstream settings;
+    settings << params.model << '\n' << params.language << '\n' << params.detect_language << params.translate
+             << params.diarize << params.tinydiarize << params.split_on_word << params.no_fallback
+             << params.no_timestamps << params.speed_up << params.word_timestamps << '\n' << params.prompt << '\n'
+             << params.offset_t_ms << ' ' << params.offset_n << ' ' << params.duration_ms << ' '
+             << params.max_context << ' ' << params.max_len << ' ' << params.best_of << ' ' << params.beam_size << ' '
+             << params.word_thold << ' ' << params.entropy_thold << ' ' << params.logprob_thold << '\n'
+             << params.vad << ' ' << params.vad_threshold_db << ' ' << params.vad_min_silence_ms << ' '
+             << params.vad_padding_ms << '\n' << (int) params.output_format << '\n' << channels.empty();
+    const std::string encoded = settings.str();
+
+    uint64_t a1;
+    uint64_t a2;
+    uint64_t b1;
+    uint64_t b2;
+    hash128(pcmf32.data(), pcmf32.size() * sizeof(float), 0, a1, a2);
+    // the downmix alone does not tell which channel spoke when, e.g. with left and right swapped
+    for (int channel = 0; channel < 2; channel++) {
+        const std::vector<double> &sums = channels.prefixSums(channel);
+        hash128(sums.data(), sums.size() * sizeof(double), a1 ^ a2, a1, a2);
+    }
+    hash128(encoded.data(), encoded.size(), a1 ^ a2, b1, b2);
+
+    char hex[33];
+    snprintf(hex, sizeof(hex), "%016llx%016llx", (unsigned long long) (a1 ^ b1), (unsigned long long) (a2 ^ b2));
+    return hex;
+}
+
+bool ResultCache::lookup(const std::string &key, std::string &result) {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto found = index.find(key);
+        if (found != index.end()) {
+            entries.splice(entries.begin(), entries, found->second);
+            result = found->second->second;
+            memoryHits++;
+            return true;
+        }
+    }
+
+    if (!directory.empty()) {
+        const std::string path = pathFor(key);
+        std::ifstream file(path, std::ios::binary);
+        if (file) {
+            result.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            // the mtime is the last use, trimDirectory deletes the oldest first
+            utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+            std::unique_lock<std::mutex> lock(mutex);
+            diskHits++;
+            insertLocked(key, result);
+            return true;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    misses++;
+    return false;
+}
+
+void ResultCache::store(const std::string &key, const std::string &result) {
+    if (!directory.empty()) {
+        // rename makes the file appear complete to concurrent readers and other replicas
+        std::string path = pathFor(key);
+        // unique per call, concurrent stores of one key and replicas with the same pid each get their own
+        std::string temporary = path + ".tmpXXXXXX";
+        int fd = mkstemp(&temporary[0]);
+        bool trim = false;
+        if (fd >= 0) {
+            bool written = fchmod(fd, 0644) == 0;
+            for (std::size_t offset = 0; written && offset < result.size();) {
+                ssize_t n = write(fd, result.data() + offset, result.size() - offset);
+                written = n > 0;
+                offset += written ? (std::size_t) n : 0;
+            }
+            written = close(fd) == 0 && written;
+            if (written && std::rename(temporary.c_str(), path.c_str()) == 0) {
+                std::unique_lock<std::mutex> lock(mutex);
+                directoryBytes += result.size();
+                trim = directoryBudget > 0 && directoryBytes > directoryBudget;
+            } else {
+                std::remove(temporary.c_str());
+            }
+        }
+        if (trim) {
+            trimDirectory();
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    stores++;
+    insertLocked(key, result);
+}
+
+ResultCacheStats ResultCache::stats() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    ResultCacheStats stats;
+    stats.memoryHits = memoryHits;
+    stats.diskHits = diskHits;
+    stats.misses = misses;
+    stats.stores = stores;
+    stats.evictions = evictions;
+    stats.entries = entries.size();
+    stats.bytes = bytes;
+    stats.budget = budget;
+    stats.diskEvictions = diskEvictions;
+    stats.diskBytes = directoryBytes;
+    stats.diskBudget = directoryBudget;
+    return stats;
+}
+
+void ResultCache::trimDirectory() {
+    // a store that finds a trim running skips it, the next store over the budget tries again
+    std::unique_lock<std::mutex> trimming(trimMutex, std::try_to_lock);
+    if (!trimming.owns_lock()) {
+        return;
+    }
+
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr) {
+        return;
+    }
+
+    struct Entry {
+        std::string path;
+        time_t used;
+        uint64_t size;
+    };
+    std::vector<Entry> files;
+    uint64_t total = 0;
+    const time_t now = time(nullptr);
+
+    while (dirent *item = readdir(dir)) {
+        const std::string name = item->d_name;
+        const std::string path = directory + "/" + name;
+        struct stat st{};
+        if (name[0] == '.' || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (name.find(".json.tmp") != std::string::npos) {
+            if (now - st.st_mtime > RESULT_CACHE_STALE_TEMPORARY_SEC) {
+                std::remove(path.c_str());
+            }
+            continue;
+        }
+        if (name.size() > 5 && name.compare(name.size() - 5, 5, ".json") == 0) {
+            files.push_back({path, st.st_mtime, (uint64_t) st.st_size});
+            total += (uint64_t) st.st_size;
+        }
+    }
+    closedir(dir);
+
+    uint64_t evicted = 0;
+    if (directoryBudget > 0 && total > directoryBudget) {
+        std::sort(files.begin(), files.end(), [](const Entry &a, const Entry &b) { return a.used < b.used; });
+        const uint64_t target = directoryBudget - directoryBudget / 10;
+        for (const auto &file: files) {
+            if (total <= target) {
+                break;
+            }
+            // another replica may have deleted it already, its bytes are gone either way
+            std::remove(file.path.c_str());
+            total -= file.size;
+            evicted++;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    directoryBytes = total;
+    diskEvictions += evicted;
+}
+
+void ResultCache::insertLocked(const std::string &key, const std::string &result) {
+    const std::size_t size = key.size() + result.size();
+    if (size > budget) {
+        return;
+    }
+
+    auto found = index.find(key);
+    if (found != index.end()) {
+        bytes -= found->second->first.size() + found->second->second.size();
+        entries.erase(found->second);
+        index.erase(found);
+    }
+
+    entries.emplace_front(key, result);
+    index[key] = entries.begin();
+    bytes += size;
+
+    while (bytes > budget) {
+        auto &oldest = entries.back();
+        bytes -= oldest.first.size() + oldest.second.size();
+        index.erase(oldest.first);
+        entries.pop_back();
+        evictions++;
+    }
+}
+
+std::string ResultCache::pathFor(const std::string &key) const {
+    return directory + "/" + key + ".json";
+}
@@ -0,0 +1,87 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_RESULT_CACHE_H
+#define TRANSCRIBER_RESULT_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "channel_energy.h"
+#include "transcriber.h"
+
+
+struct ResultCacheStats {
+    uint64_t memoryHits = 0;
+    uint64_t diskHits = 0;
+    uint64_t misses = 0;
+    uint64_t stores = 0;
+    uint64_t evictions = 0;
+    std::size_t entries = 0;
+    std::size_t bytes = 0;
+    std::size_t budget = 0;
+    uint64_t diskEvictions = 0;
+    uint64_t diskBytes = 0;
+    uint64_t diskBudget = 0;
+};
+
+// Finished transcriptions keyed by a 128-bit hash of the decoded PCM, the channel energies and every parameter that shapes the
+// output. The memory tier is an LRU bounded by a byte budget; the optional disk tier keeps one file per
+// key in a directory so results survive restarts and can be shared by replicas mounting it. The disk tier
+// has its own budget, files are touched on every hit and the oldest by mtime are deleted beyond it.
+class ResultCache {
+public:
+    // budget 0 disables the memory tier, an empty directory the disk tier, directoryBudget 0 never deletes
+    ResultCache(std::size_t budget, std::string directory, uint64_t directoryBudget);
+
+    [[nodiscard]] bool enabled() const { return budget > 0 || !directory.empty(); }
+
+    static std::string key(const std::vector<float> &pcmf32, const ChannelEnergy &channels,
+                           const TranscribeParams &params);
+
+    bool lookup(const std::string &key, std::string &result);
+
+    void store(const std::string &key, const std::string &result);
+
+    ResultCacheStats stats();
+
+private:
+    void insertLocked(const std::string &key, const std::string &result);
+
+    std::string pathFor(const std::string &key) const;
+
+    // Sums the directory, removes temporaries a crashed writer left behind and, over the budget, deletes
+    // the least recently used entries until a tenth of it is free again. Replicas sharing the directory
+    // each trim it, the sum is taken from the files rather than from what this process wrote.
+    void trimDirectory();
+
+    std::size_t budget;
+    std::string directory;
+    uint64_t directoryBudget;
+
+    // estimate of the directory size between trims, and the single trim that may run at a time
+    uint64_t directoryBytes = 0;
+    uint64_t diskEvictions = 0;
+    std::mutex trimMutex;
+
+    // most recently used first
+    std::list<std::pair<std::string, std::string>> entries;
+    std::unordered_map<std::string, std::list<std::pair<std::string, std::string>>::iterator> index;
+    std::size_t bytes = 0;
+
+    uint64_t memoryHits = 0;
+    uint64_t diskHits = 0;
+    uint64_t misses = 0;
+    uint64_t stores = 0;
+    uint64_t evictions = 0;
+    std::mutex mutex;
+};
+
+
+#endif //TRANSCRIBER_RESULT_CACHE_H
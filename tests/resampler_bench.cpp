@@ -0,0 +1,46 @@
+//
+// Created by j on 18/10/26.
+//
+
+// Throughput of PolyphaseResampler on one core for every common input rate, as multiples of realtime.
+
+#include "resampler.h"
+#include "audio_kernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#define OUTPUT_RATE 16000
+#define BENCH_SECONDS 60
+// the block size StreamingAudioDecoder hands to the resampler
+#define BENCH_BLOCK 4096
+
+
+int main() {
+    std::printf("kernels: %s\n", AudioKernels::isa());
+    PolyphaseResampler::precomputeCommonBanks(OUTPUT_RATE);
+
+    for (uint32_t rate: {8000u, 11025u, 22050u, 24000u, 32000u, 44100u, 48000u}) {
+        std::vector<float> input((size_t) rate * BENCH_SECONDS);
+        for (size_t i = 0; i < input.size(); i++) {
+            input[i] = (float) (0.5 * std::sin(2.0 * M_PI * 440 * (double) i / rate));
+        }
+
+        std::vector<float> output;
+        output.reserve((size_t) OUTPUT_RATE * BENCH_SECONDS + 1024);
+        auto start = std::chrono::steady_clock::now();
+        PolyphaseResampler resampler(rate, OUTPUT_RATE);
+        for (size_t offset = 0; offset < input.size(); offset += BENCH_BLOCK) {
+            resampler.process(input.data() + offset, std::min<size_t>(BENCH_BLOCK, input.size() - offset), output);
+        }
+        resampler.flush(output);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::printf("%5u Hz -> %u Hz: %8.1f ms for %d s, %7.0fx realtime\n", rate, OUTPUT_RATE, seconds * 1000,
+                    BENCH_SECONDS, BENCH_SECONDS / seconds);
+    }
+    return 0;
+}
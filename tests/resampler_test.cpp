@@ -0,0 +1,104 @@
+//
+// Created by j on 18/10/26.
+//
+
+// Checks PolyphaseResampler against analytic sine references at every common input rate.
+// Exits non-zero when a case falls below its threshold, run by ctest.
+
+#include "resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#define OUTPUT_RATE 16000
+#define TEST_SECONDS 2
+// samples at either end left out of the comparison, the filter is still filling there
+#define EDGE_SAMPLES 256
+
+
+namespace {
+
+    std::vector<float> sine(uint32_t rate, double frequency, size_t n) {
+        std::vector<float> samples(n);
+        for (size_t i = 0; i < n; i++) {
+            samples[i] = (float) (0.5 * std::sin(2.0 * M_PI * frequency * (double) i / rate));
+        }
+        return samples;
+    }
+
+    // pushes input in uneven blocks so the state carried between calls is exercised as well
+    std::vector<float> resample(uint32_t inputRate, const std::vector<float> &input) {
+        PolyphaseResampler resampler(inputRate, OUTPUT_RATE);
+        std::vector<float> output;
+        size_t offset = 0;
+        for (size_t block = 1; offset < input.size(); block = block * 3 + 7) {
+            const size_t n = std::min(block % 4096 + 1, input.size() - offset);
+            resampler.process(input.data() + offset, n, output);
+            offset += n;
+        }
+        resampler.flush(output);
+        return output;
+    }
+
+    // SNR of output against the same sine sampled directly at OUTPUT_RATE
+    double snrDb(const std::vector<float> &output, double frequency) {
+        const std::vector<float> reference = sine(OUTPUT_RATE, frequency, output.size());
+        double signal = 0, noise = 0;
+        for (size_t i = EDGE_SAMPLES; i + EDGE_SAMPLES < output.size(); i++) {
+            signal += (double) reference[i] * reference[i];
+            noise += ((double) output[i] - reference[i]) * ((double) output[i] - reference[i]);
+        }
+        return 10 * std::log10(signal / std::max(noise, 1e-30));
+    }
+
+    // level of output relative to a full 0.5 amplitude sine
+    double levelDb(const std::vector<float> &output) {
+        double energy = 0;
+        size_t n = 0;
+        for (size_t i = EDGE_SAMPLES; i + EDGE_SAMPLES < output.size(); i++, n++) {
+            energy += (double) output[i] * output[i];
+        }
+        return 10 * std::log10(std::max(energy / (double) n, 1e-30) / 0.125);
+    }
+
+}
+
+int main() {
+    int failures = 0;
+
+    for (uint32_t rate: {8000u, 11025u, 22050u, 24000u, 32000u, 44100u, 48000u}) {
+        const size_t n = (size_t) rate * TEST_SECONDS;
+        const size_t expected = ((uint64_t) n * OUTPUT_RATE + rate - 1) / rate;
+
+        const std::vector<float> output = resample(rate, sine(rate, 1000, n));
+        if (output.size() != expected) {
+            std::printf("FAIL %5u Hz: %zu samples instead of %zu\n", rate, output.size(), expected);
+            failures++;
+            continue;
+        }
+
+        // a tone well inside the passband of the narrower of the two rates
+        const double snr = snrDb(output, 1000);
+        const bool passed = snr >= 80;
+        std::printf("%s %5u Hz: 1 kHz SNR %.1f dB\n", passed ? "ok  " : "FAIL", rate, snr);
+        failures += !passed;
+
+        // a tone above the output Nyquist has to be filtered out, not folded back
+        if (rate > OUTPUT_RATE) {
+            const double alias = levelDb(resample(rate, sine(rate, OUTPUT_RATE * 0.5 + 1500, n)));
+            const bool rejected = alias <= -80;
+            std::printf("%s %5u Hz: %.0f Hz alias %.1f dB\n", rejected ? "ok  " : "FAIL", rate,
+                        OUTPUT_RATE * 0.5 + 1500, alias);
+            failures += !rejected;
+        }
+    }
+
+    if (!PolyphaseResampler::supports(44100, 16000) || PolyphaseResampler::supports(0, 16000)) {
+        std::printf("FAIL supports()\n");
+        failures++;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
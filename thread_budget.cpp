@@ -0,0 +1,155 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "thread_budget.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <utility>
+
+
+namespace {
+
+    int readTopologyValue(int cpu, const char *name) {
+        std::ifstream ifs("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/" + name);
+        int value = -1;
+        if (!(ifs >> value)) {
+            return -1;
+        }
+        return value;
+    }
+
+}
+
+CpuTopology CpuTopology::detect() {
+    CpuTopology topology;
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        topology.cores.push_back({0});
+        return topology;
+    }
+
+    // respect cpusets: only CPUs this process may run on count towards the budget
+    std::map<std::pair<int, int>, std::vector<int>> byCore;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        int package = readTopologyValue(cpu, "physical_package_id");
+        int core = readTopologyValue(cpu, "core_id");
+        if (core < 0) {
+            // no sysfs topology, treat every logical CPU as its own core
+            core = cpu;
+            package = -1;
+        }
+        byCore[{package, core}].push_back(cpu);
+    }
+
+    for (auto &entry: byCore) {
+        topology.cores.push_back(std::move(entry.second));
+    }
+    std::sort(topology.cores.begin(), topology.cores.end());
+    return topology;
+}
+
+ThreadBudget::ThreadBudget(std::size_t workers, int budget, bool useSmt, bool pinThreads, int maxThreadsPerRequest)
+        : pinThreads(pinThreads),
+          maxThreadsPerRequest(std::max(1, maxThreadsPerRequest)) {
+
+    CpuTopology topology = CpuTopology::detect();
+
+    // primaries of every core first, so even with SMT grants spread over distinct cores before doubling up
+    for (const auto &core: topology.cores) {
+        slots.push_back(core.front());
+    }
+    if (useSmt) {
+        for (const auto &core: topology.cores) {
+            slots.insert(slots.end(), core.begin() + 1, core.end());
+        }
+    }
+
+    if (slots.empty()) {
+        slots.push_back(0);
+    }
+
+    if (budget > 0 && (std::size_t) budget < slots.size()) {
+        slots.resize(budget);
+    }
+
+    slotInUse.assign(slots.size(), false);
+    workerCount = std::min(std::max<std::size_t>(1, workers), slots.size());
+    minShare = std::max(1, (int) (slots.size() / workerCount));
+}
+
+int ThreadBudget::inUse() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return (int) std::count(slotInUse.begin(), slotInUse.end(), true);
+}
+
+std::vector<int> ThreadBudget::reserve() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    // only with more workers than cores, e.g. more models than cores, can they all be taken
+    released.wait(lock, [this]() { return std::count(slotInUse.begin(), slotInUse.end(), false) > 0; });
+    const int free = (int) std::count(slotInUse.begin(), slotInUse.end(), false);
+
+    // keep the minimum share of every worker that could still start
+    const int idleWorkers = (int) workerCount - (int) activeGrants - 1;
+    const int reserved = std::max(0, idleWorkers) * minShare;
+
+    int count = std::max(minShare, free - reserved);
+    count = std::min(count, std::min(free, maxThreadsPerRequest));
+    count = std::max(count, 1);
+
+    std::vector<int> granted;
+    for (std::size_t i = 0; i < slots.size() && (int) granted.size() < count; i++) {
+        if (!slotInUse[i]) {
+            slotInUse[i] = true;
+            granted.push_back((int) i);
+        }
+    }
+
+    activeGrants++;
+    return granted;
+}
+
+void ThreadBudget::release(const std::vector<int> &granted) {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (int slot: granted) {
+        slotInUse[slot] = false;
+    }
+    activeGrants--;
+    released.notify_all();
+}
+
+ThreadGrant::ThreadGrant(ThreadBudget &budget) : budget(budget), slots(budget.reserve()) {
+
+    if (!budget.pinThreads) {
+        return;
+    }
+
+    if (pthread_getaffinity_np(pthread_self(), sizeof(previousAffinity), &previousAffinity) != 0) {
+        return;
+    }
+
+    cpu_set_t affinity;
+    CPU_ZERO(&affinity);
+    for (int slot: slots) {
+        CPU_SET(budget.slots[slot], &affinity);
+    }
+    pinned = pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity) == 0;
+}
+
+ThreadGrant::~ThreadGrant() {
+    if (pinned) {
+        pthread_setaffinity_np(pthread_self(), sizeof(previousAffinity), &previousAffinity);
+    }
+    budget.release(slots);
+}
@@ -0,0 +1,81 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_THREAD_BUDGET_H
+#define TRANSCRIBER_THREAD_BUDGET_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <sched.h>
+#include <vector>
+
+
+// Logical CPUs this process may run on, grouped by physical core
+struct CpuTopology {
+    std::vector<std::vector<int>> cores;
+
+    static CpuTopology detect();
+};
+
+class ThreadGrant;
+
+// Owns the host's core budget and splits it between the inferences running at the same time.
+// Every grant gets at least budget / workers cores and may borrow cores idle workers are not
+// using, as long as enough stay free to give every other worker its minimum share. A grant
+// waits while every core is taken instead of oversubscribing them.
+class ThreadBudget {
+public:
+    ThreadBudget(std::size_t workers, int budget, bool useSmt, bool pinThreads, int maxThreadsPerRequest);
+
+    [[nodiscard]] int budget() const { return (int) slots.size(); }
+
+    // Workers the budget can serve, never more than there are cores to give them
+    [[nodiscard]] std::size_t workers() const { return workerCount; }
+
+    int inUse();
+
+private:
+    friend class ThreadGrant;
+
+    std::vector<int> reserve();
+
+    void release(const std::vector<int> &granted);
+
+    std::size_t workerCount;
+    bool pinThreads;
+    int maxThreadsPerRequest;
+    int minShare;
+
+    // one logical CPU per slot; without SMT only the first sibling of each core is used
+    std::vector<int> slots;
+    std::vector<bool> slotInUse;
+    std::size_t activeGrants = 0;
+    std::mutex mutex;
+    std::condition_variable released;
+};
+
+// Cores reserved for one inference. The calling thread is pinned to them for the lifetime of the
+// grant, and the compute threads ggml spawns from it inherit that affinity.
+class ThreadGrant {
+public:
+    explicit ThreadGrant(ThreadBudget &budget);
+
+    ~ThreadGrant();
+
+    ThreadGrant(const ThreadGrant &) = delete;
+
+    ThreadGrant &operator=(const ThreadGrant &) = delete;
+
+    [[nodiscard]] int threads() const { return (int) slots.size(); }
+
+private:
+    ThreadBudget &budget;
+    std::vector<int> slots;
+    cpu_set_t previousAffinity;
+    bool pinned = false;
+};
+
+
+#endif //TRANSCRIBER_THREAD_BUDGET_H
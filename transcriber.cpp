@@ -3,188 +3,203 @@
 //
 
 #include "transcriber.h"
+#include "model_loader.h"
+#include "vad.h"
+#include "audio_tooling.h"
+#include "json_writer.h"
+#include "transcript_format.h"
 
 
+#include <algorithm>
 #include <iostream>
-#include <sstream>
 #include <vector>
 #include <stack>
 #include <thread>
 #include <mutex>
 #include <cmath>
+#include <exception>
 
-int timestampToSample(int64_t t, int n_samples) {
-    return std::max(0, std::min((int) n_samples - 1, (int) ((t*WHISPER_SAMPLE_RATE)/100)));
-}
-
-std::string estimate_diarization_speaker(std::vector<std::vector<float>> pcmf32s, int64_t t0, int64_t t1, bool id_only = false) {
-    std::string speaker;
-    const int64_t n_samples = pcmf32s[0].size();
+// a worker never reserves more than this up front, longer responses grow past it as they are written
+#define OUTPUT_CAPACITY_MAX (1024 * 1024)
 
-    const int64_t is0 = timestampToSample(t0, n_samples);
-    const int64_t is1 = timestampToSample(t1, n_samples);
 
-    double energy0 = 0.0f;
-    double energy1 = 0.0f;
-
-    for (int64_t j = is0; j < is1; j++) {
-        energy0 += fabs(pcmf32s[0][j]);
-        energy1 += fabs(pcmf32s[1][j]);
-    }
+namespace {
 
-    if (energy0 > 1.1*energy1) {
-        speaker = "0";
-    } else if (energy1 > 1.1*energy0) {
-        speaker = "1";
-    } else {
-        speaker = "?";
+    // The reservation for the next response follows the recent ones: it covers the last response with some
+    // headroom, and halves after a larger one instead of keeping one multi-hour transcript's size for good.
+    // A body that ended up far smaller than its reservation gives the excess back, it may be retained.
+    void fitCapacity(std::string &body, std::size_t &capacityHint) {
+        capacityHint = std::min<std::size_t>(OUTPUT_CAPACITY_MAX,
+                                             std::max(body.size() + body.size() / 8, capacityHint / 2));
+        if (body.capacity() > 2 * body.size()) {
+            body.shrink_to_fit();
+        }
     }
 
-    //printf("is0 = %lld, is1 = %lld, energy0 = %f, energy1 = %f, speaker = %s\n", is0, is1, energy0, energy1, speaker.c_str());
+}
 
-    if (!id_only) {
-        speaker.insert(0, "(speaker ");
-        speaker.append(")");
+std::string output_json(struct whisper_context * ctx, const TranscribeParams & params, const TranscriptResult & result,
+                        std::size_t & capacityHint) {
+    // sized from the previous response of this worker, the buffer becomes the response body as is
+    std::string json;
+    json.reserve(capacityHint);
+
+    JsonWriter writer(json);
+    writer.beginObject()
+            .string("systeminfo", whisper_print_system_info())
+            .beginObject("model")
+            .string("type", whisper_model_type_readable(ctx))
+            .boolean("multilingual", whisper_is_multilingual(ctx))
+            .number("vocab", whisper_model_n_vocab(ctx))
+            .beginObject("audio")
+            .number("ctx", whisper_model_n_audio_ctx(ctx))
+            .number("state", whisper_model_n_audio_state(ctx))
+            .number("head", whisper_model_n_audio_head(ctx))
+            .number("layer", whisper_model_n_audio_layer(ctx))
+            .endObject()
+            .beginObject("text")
+            .number("ctx", whisper_model_n_text_ctx(ctx))
+            .number("state", whisper_model_n_text_state(ctx))
+            .number("head", whisper_model_n_text_head(ctx))
+            .number("layer", whisper_model_n_text_layer(ctx))
+            .endObject()
+            .number("mels", whisper_model_n_mels(ctx))
+            .number("ftype", whisper_model_ftype(ctx))
+            .endObject()
+            .beginObject("params")
+            .string("model", params.model)
+            .string("language", params.language)
+            .boolean("translate", params.translate)
+            .endObject()
+            .beginObject("result")
+            .string("language", result.language)
+            .endObject()
+            .beginArray("transcription");
+
+    for (const auto &segment: result.segments) {
+        writer.beginObject()
+                .beginObject("timestamps")
+                .timestamp("from", segment.t0)
+                .timestamp("to", segment.t1)
+                .endObject()
+                .beginObject("offsets")
+                .number("from", segment.t0 * 10)
+                .number("to", segment.t1 * 10)
+                .endObject()
+                .string("text", segment.text);
+        TranscriptFormats::annotations(writer, segment);
+        writer.endObject();
     }
 
-    return speaker;
+    writer.endArray().endObject();
+    json.push_back('\n');
+
+    fitCapacity(json, capacityHint);
+    return json;
 }
 
 
-std::string output_json(struct whisper_context * ctx, const TranscribeParams & params) {
-    std::stringstream jsonStream;
-    int indent = 0;
 
-    auto doindent = [&]() {
-        for (int i = 0; i < indent; i++)
-            jsonStream << "\t";
-    };
+// Implement your item's constructor and methods here
+TranscribeWorker::TranscribeWorker() {
 
-    auto start_arr = [&](const char *name) {
-        doindent();
-        jsonStream << "\"" << name << "\": [\n";
-        indent++;
-    };
+}
 
-    auto end_arr = [&](bool end) {
-        indent--;
-        doindent();
-        jsonStream << (end ? "]\n" : "},\n");
-    };
+TranscribeWorker::~TranscribeWorker() {
+    if (ownsContext) {
+        whisper_free(context);
+        return;
+    }
+    if (state == nullptr) {
+        return;
+    }
+    whisper_free_state(state);
+}
 
-    auto start_obj = [&](const char *name) {
-        doindent();
-        if (name) {
-            jsonStream << "\"" << name << "\": {\n";
-        } else {
-            jsonStream << "{\n";
+namespace {
+
+    // Segment i of the last run, reported on the original timeline when silence was removed before inference.
+    // Speakers are looked up there as well, channels is null without diarization.
+    TranscriptSegment readSegment(whisper_context *ctx, whisper_state *state, int i, bool words,
+                                  const OffsetMap *offsets, const ChannelEnergy *channels) {
+        TranscriptSegment segment;
+        segment.t0 = whisper_full_get_segment_t0_from_state(state, i);
+        segment.t1 = whisper_full_get_segment_t1_from_state(state, i);
+        segment.text = whisper_full_get_segment_text_from_state(state, i);
+
+        if (words) {
+            const whisper_token eot = whisper_token_eot(ctx);
+            const int n_tokens = whisper_full_n_tokens_from_state(state, i);
+            segment.words.reserve((std::size_t) n_tokens);
+            for (int j = 0; j < n_tokens; j++) {
+                const whisper_token_data token = whisper_full_get_token_data_from_state(state, i, j);
+                // timestamp and control tokens all sort after end of text
+                if (token.id >= eot) {
+                    continue;
+                }
+                TranscriptWord word;
+                word.t0 = token.t0;
+                word.t1 = token.t1;
+                word.p = token.p;
+                word.text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                segment.words.push_back(std::move(word));
+            }
         }
-        indent++;
-    };
-
-    auto end_obj = [&](bool end) {
-        indent--;
-        doindent();
-        jsonStream << (end ? "}\n" : "},\n");
-    };
-
-    auto start_value = [&](const char *name) {
-        doindent();
-        jsonStream << "\"" << name << "\": ";
-    };
-
-    auto value_s = [&](const char *name, const char *val, bool end) {
-        start_value(name);
-        std::string val_escaped = Utils::escapeDoubleQuotesAndBackslashes(val);
-        jsonStream << "\"" << val_escaped << (end ? "\"\n" : "\",\n");
-    };
-
-    auto end_value = [&](bool end) {
-        jsonStream << (end ? "\n" : ",\n");
-    };
 
-    auto value_i = [&](const char *name, const int64_t val, bool end) {
-        start_value(name);
-        jsonStream << val;
-        end_value(end);
-    };
+        if (offsets) {
+            remapSegment(segment, [offsets](int64_t t, bool end) { return offsets->toOriginal(t, end); });
+        }
+        if (channels) {
+            segment.speaker = channels->speaker(segment.t0, segment.t1);
+        }
+        return segment;
+    }
 
-    auto value_b = [&](const char *name, const bool val, bool end) {
-        start_value(name);
-        jsonStream << (val ? "true" : "false");
-        end_value(end);
+    struct SegmentStream {
+        const SegmentCallback *onSegment;
+        const OffsetMap *offsets;
+        const ChannelEnergy *channels;
+        bool words;
+        bool cancelled = false;
     };
 
-    start_obj(nullptr);
-    value_s("systeminfo", whisper_print_system_info(), false);
-    start_obj("model");
-    value_s("type", whisper_model_type_readable(ctx), false);
-    value_b("multilingual", whisper_is_multilingual(ctx), false);
-    value_i("vocab", whisper_model_n_vocab(ctx), false);
-    start_obj("audio");
-    value_i("ctx", whisper_model_n_audio_ctx(ctx), false);
-    value_i("state", whisper_model_n_audio_state(ctx), false);
-    value_i("head", whisper_model_n_audio_head(ctx), false);
-    value_i("layer", whisper_model_n_audio_layer(ctx), true);
-    end_obj(false);
-    start_obj("text");
-    value_i("ctx", whisper_model_n_text_ctx(ctx), false);
-    value_i("state", whisper_model_n_text_state(ctx), false);
-    value_i("head", whisper_model_n_text_head(ctx), false);
-    value_i("layer", whisper_model_n_text_layer(ctx), true);
-    end_obj(false);
-    value_i("mels", whisper_model_n_mels(ctx), false);
-    value_i("ftype", whisper_model_ftype(ctx), true);
-    end_obj(false);
-    start_obj("params");
-    value_s("model", params.model.c_str(), false);
-    value_s("language", params.language.c_str(), false);
-    value_b("translate", params.translate, true);
-    end_obj(false);
-    start_obj("result");
-    value_s("language", whisper_lang_str(whisper_full_lang_id(ctx)), true);
-    end_obj(false);
-    start_arr("transcription");
-
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-
-        start_obj(nullptr);
-        start_obj("timestamps");
-        value_s("from", Utils::toTimestamp(t0, true).c_str(), false);
-        value_s("to", Utils::toTimestamp(t1, true).c_str(), true);
-        end_obj(false);
-        start_obj("offsets");
-        value_i("from", t0 * 10, false);
-        value_i("to", t1 * 10, true);
-        end_obj(false);
-        end_obj(i == (n_segments - 1));
+    void onNewSegment(whisper_context *ctx, whisper_state *state, int n_new, void *user_data) {
+        auto *stream = static_cast<SegmentStream *>(user_data);
+        const int n_segments = whisper_full_n_segments_from_state(state);
+        for (int i = n_segments - n_new; i < n_segments && !stream->cancelled; i++) {
+            stream->cancelled = !(*stream->onSegment)(readSegment(ctx, state, i, stream->words, stream->offsets,
+                                                                          stream->channels));
+        }
     }
 
-    end_arr(true);
-    end_obj(true);
-    return jsonStream.str();;
-}
-
-
+    // checked before every 30 s window, stops the work for a client that went away
+    bool onEncoderBegin(whisper_context * /*ctx*/, whisper_state * /*state*/, void *user_data) {
+        return !static_cast<SegmentStream *>(user_data)->cancelled;
+    }
 
-// Implement your item's constructor and methods here
-TranscribeWorker::TranscribeWorker() {
+    // whisper_full runs on the default state, which is otherwise not reachable, and stops before encoding
+    bool captureDefaultState(whisper_context * /*ctx*/, whisper_state *state, void *user_data) {
+        *static_cast<whisper_state **>(user_data) = state;
+        return false;
+    }
 
 }
 
-TranscribeWorker::~TranscribeWorker() {
-    if (context == nullptr) {
-        return;
+std::string TranscribeWorker::Render(const TranscribeParams &params, const TranscriptResult &result) {
+    if (params.output_format == OutputFormat::Json) {
+        return output_json(context, params, result, outputCapacity);
     }
-    whisper_free(context);
+
+    std::string body;
+    body.reserve(outputCapacity);
+    TranscriptFormats::render(body, params.output_format, result);
+    fitCapacity(body, outputCapacity);
+    return body;
 }
 
-std::string TranscribeWorker::Transcribe(TranscribeParams &params, std::vector<float> pcmf32, std::vector<std::vector<float>> &pcmf32s) {
+TranscriptResult TranscribeWorker::TranscribeSegments(TranscribeParams &params, const float *samples, std::size_t n_samples,
+                                                      const SegmentCallback &onSegment, const OffsetMap *offsets,
+                                                      const ChannelEnergy *channels) {
 
     whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
 
@@ -202,9 +217,11 @@ std::string TranscribeWorker::Transcribe(TranscribeParams &params, std::vector<f
     wparams.offset_ms        = params.offset_t_ms;
     wparams.duration_ms      = params.duration_ms;
 
-    wparams.token_timestamps = params.max_len > 0;
+    // token times cost an extra pass over every segment, only run it when words are asked for or
+    // max_len has to split segments by them
+    wparams.token_timestamps = params.word_timestamps || params.max_len > 0;
     wparams.thold_pt         = params.word_thold;
-    wparams.max_len          = params.max_len == 0 ? 60 : params.max_len;
+    wparams.max_len          = params.max_len;
     wparams.split_on_word    = params.split_on_word;
 
     wparams.speed_up         = params.speed_up;
@@ -221,59 +238,625 @@ std::string TranscribeWorker::Transcribe(TranscribeParams &params, std::vector<f
     wparams.logprob_thold    = params.logprob_thold;
 
 
-    int transcription_result = whisper_full_parallel(context, wparams, pcmf32.data(), pcmf32.size(), params.n_processors);
+    if (offsets && offsets->empty()) {
+        offsets = nullptr;
+    }
+
+    if (!params.diarize || (channels && channels->empty())) {
+        channels = nullptr;
+    }
+
+    SegmentStream stream{&onSegment, offsets, channels, params.word_timestamps};
+    if (onSegment) {
+        wparams.new_segment_callback = onNewSegment;
+        wparams.new_segment_callback_user_data = &stream;
+        wparams.encoder_begin_callback = onEncoderBegin;
+        wparams.encoder_begin_callback_user_data = &stream;
+    }
+
+    // one pass per request, parallelism comes from the threads the budget granted
+    int transcription_result = whisper_full_with_state(context, state, wparams, samples, (int) n_samples);
+    if (stream.cancelled) {
+        throw TranscribeException("transcription cancelled");
+    }
     if( transcription_result != 0) {
         throw TranscribeException("Failed to transcribe audio");
     }
 
-    return output_json(context,  params);
+    TranscriptResult result;
+    result.language = whisper_lang_str(whisper_full_lang_id_from_state(state));
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
+    result.segments.reserve((std::size_t) n_segments);
+    for (int i = 0; i < n_segments; ++i) {
+        result.segments.push_back(readSegment(context, state, i, params.word_timestamps, offsets, channels));
+    }
+    return result;
 }
 
-void TranscribeWorker::Initialize(TranscribeParams &params) {
+std::string TranscribeWorker::TranscribeWindow(TranscribeParams &params, const std::vector<float> &window,
+                                               std::vector<whisper_token> &promptTokens, bool keepTokens) {
+
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
 
-    context = whisper_init_from_file(params.model.c_str());
+    wparams.print_realtime   = false;
+    wparams.print_progress   = false;
+    wparams.print_timestamps = false;
+    wparams.print_special    = false;
+    wparams.translate        = params.translate;
+    wparams.language         = params.language.c_str();
+    wparams.n_threads        = params.n_threads;
+    wparams.speed_up         = params.speed_up;
+    wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
+
+    // the only context is what the caller carries over from the previous final window
+    wparams.no_context       = true;
+    wparams.single_segment   = true;
+    wparams.prompt_tokens    = promptTokens.empty() ? nullptr : promptTokens.data();
+    wparams.prompt_n_tokens  = (int) promptTokens.size();
+
+    if (whisper_full_with_state(context, state, wparams, window.data(), (int) window.size()) != 0) {
+        throw TranscribeException("Failed to transcribe audio window");
+    }
 
+    if (keepTokens) {
+        promptTokens.clear();
+    }
+
+    std::string text;
+    const int n_segments = whisper_full_n_segments_from_state(state);
+    for (int i = 0; i < n_segments; ++i) {
+        text += whisper_full_get_segment_text_from_state(state, i);
+        if (keepTokens) {
+            const int n_tokens = whisper_full_n_tokens_from_state(state, i);
+            for (int j = 0; j < n_tokens; ++j) {
+                promptTokens.push_back(whisper_full_get_token_id_from_state(state, i, j));
+            }
+        }
+    }
+    return text;
+}
+
+void TranscribeWorker::Initialize(whisper_context *sharedContext) {
+
+    context = sharedContext;
+    state = whisper_init_state(context);
+
+    if (state == nullptr) {
+        throw TranscribeInitException( "failed to initialize whisper state");
+    }
+}
+
+void TranscribeWorker::InitializeOpenVino(const std::string &model, const std::string &device) {
+
+    // the pages of the mapping are shared with the other workers, the tensors ggml copies them into are not
+    MappedModelFile modelFile(model, false, false);
+    context = modelFile.load(true);
     if (context == nullptr) {
-        throw TranscribeInitException( "failed to initialize whisper context");
+        throw TranscribeInitException("failed to initialize whisper context");
     }
+    ownsContext = true;
 
-    whisper_ctx_init_openvino_encoder(context, nullptr, params.openvino_encode_device.c_str(), nullptr);
+    // the encoder is found next to the model as <model>-encoder-openvino.xml
+    if (whisper_ctx_init_openvino_encoder(context, model.c_str(), device.c_str(), nullptr) != 0) {
+        throw TranscribeInitException("failed to initialize the OpenVINO encoder on " + device + " for " + model +
+                                      ", whisper.cpp has to be built with WHISPER_OPENVINO");
+    }
+
+    std::vector<float> silence(WHISPER_SAMPLE_RATE, 0.0f);
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    wparams.print_progress = false;
+    wparams.encoder_begin_callback = captureDefaultState;
+    wparams.encoder_begin_callback_user_data = &state;
+    whisper_full(context, wparams, silence.data(), (int) silence.size());
+
+    if (state == nullptr) {
+        throw TranscribeInitException("failed to initialize whisper state");
+    }
 }
 
-TranscriberPool::TranscriberPool(std::size_t poolSize, TranscribeParams params) {
-    // Fill the pool with reusable items
-    for (std::size_t i = 0; i < poolSize; ++i) {
-        auto wrkr = new TranscribeWorker();
-        wrkr->Initialize(params);
-        pool.push(wrkr);
+void TranscribeWorker::Warmup(int n_threads) {
+
+    // whisper pads any input to a full 30 s window, so one second of silence runs the full encoder
+    std::vector<float> silence(WHISPER_SAMPLE_RATE, 0.0f);
+
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    wparams.print_realtime   = false;
+    wparams.print_progress   = false;
+    wparams.print_timestamps = false;
+    wparams.print_special    = false;
+    wparams.n_threads        = n_threads;
+    wparams.no_context       = true;
+    wparams.single_segment   = true;
+    wparams.max_tokens       = 1;
+    wparams.temperature_inc  = 0.0f;
+
+    if (whisper_full_with_state(context, state, wparams, silence.data(), (int) silence.size()) != 0) {
+        throw TranscribeInitException("warm-up inference failed");
     }
 }
 
+TranscriberPool::TranscriberPool(std::size_t poolSize, TranscribeParams params)
+        : TranscriberPool(poolSize, params,
+                          std::make_shared<ThreadBudget>(poolSize, params.thread_budget, params.thread_use_smt,
+                                                         params.thread_pinning, params.n_threads)) {
+}
+
+TranscriberPool::TranscriberPool(std::size_t poolSize, TranscribeParams params, std::shared_ptr<ThreadBudget> budget)
+        : threadBudget(std::move(budget)),
+          size(std::min(std::max<std::size_t>(1, poolSize), threadBudget->workers())),
+          maxQueueDepth((std::size_t) std::max(0, params.max_queue_depth)),
+          maxQueueWait(std::max(0, params.max_queue_wait_ms)),
+          weights{std::max(1, params.priority_weight_interactive), std::max(1, params.priority_weight_standard),
+                  std::max(1, params.priority_weight_batch)},
+          maxStarvation(std::max(0, params.priority_max_wait_ms)) {
+
+    // the server listens while this runs, so readiness probes can see start-up progress
+    startup = std::thread(&TranscriberPool::start, this, std::move(params));
+}
+
+void TranscriberPool::start(TranscribeParams params) {
+    auto begin = std::chrono::steady_clock::now();
+
+    try {
+        // the weights are loaded once and shared read-only, each worker only owns its KV/compute buffers.
+        // Reading them through a mapping serves the file from the page cache every replica shares.
+        std::cout << "Loading " << params.model << (params.model_prefetch ? " with" : " without") << " prefetch"
+                  << (params.model_mlock ? ", locked" : "") << std::endl;
+        modelFile = std::make_unique<MappedModelFile>(params.model, params.model_prefetch, params.model_mlock);
+
+        // with OpenVINO every worker loads its own context from the mapping instead
+        const bool openVino = !params.openvino_encode_device.empty();
+        if (openVino) {
+            std::cout << "OpenVINO encoder on " << params.openvino_encode_device
+                      << ", every worker holds its own copy of the weights" << std::endl;
+        } else {
+            context = modelFile->load();
+            if (context == nullptr) {
+                throw TranscribeInitException( "failed to initialize whisper context");
+            }
+        }
+
+        // Fill the pool concurrently, each worker joins as soon as it is warm
+        std::vector<std::string> errors(size);
+        std::vector<std::thread> initializers;
+        for (std::size_t i = 0; i < size; ++i) {
+            initializers.emplace_back([this, &params, &errors, openVino, i]() {
+                auto wrkr = std::make_unique<TranscribeWorker>();
+                try {
+                    if (openVino) {
+                        wrkr->InitializeOpenVino(params.model, params.openvino_encode_device);
+                    } else {
+                        wrkr->Initialize(context);
+                    }
+                    if (params.warmup) {
+                        // warm-ups share the core budget like real requests instead of oversubscribing it
+                        ThreadGrant grant(*threadBudget);
+                        wrkr->Warmup(grant.threads());
+                    }
+                } catch (const std::exception &e) {
+                    errors[i] = e.what();
+                    return;
+                }
+
+                std::unique_lock<std::mutex> lock(mutex);
+                handOffLocked(wrkr.release());
+            });
+        }
+        for (auto &initializer: initializers) {
+            initializer.join();
+        }
+
+        // ggml copies the tensors into its own buffers, the mapping only stays to pin the cached file
+        if (!modelFile->locked()) {
+            modelFile.reset();
+        }
+
+        for (const auto &error: errors) {
+            if (!error.empty()) {
+                throw TranscribeInitException(error);
+            }
+        }
+
+    } catch (const std::exception &e) {
+        std::unique_lock<std::mutex> lock(mutex);
+        startupFailed = true;
+        startupError = e.what();
+        startupCv.notify_all();
+        return;
+    }
+
+    double startupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << size << (params.warmup ? " warm" : " cold") << " workers ready in " << startupMs << " ms"
+              << std::endl;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    isReady = true;
+    startupCv.notify_all();
+}
+
 TranscriberPool::~TranscriberPool() {
+    startup.join();
+
     // Deallocate all objects when the pool is destroyed
     while (!pool.empty()) {
         delete pool.top();
         pool.pop();
     }
+    whisper_free(context);
+}
+
+bool TranscriberPool::ready() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return isReady;
+}
+
+void TranscriberPool::waitUntilReady() {
+    std::unique_lock<std::mutex> lock(mutex);
+    startupCv.wait(lock, [this]() { return isReady || startupFailed; });
+    if (startupFailed) {
+        throw TranscribeInitException(startupError);
+    }
+}
+
+TranscribeWorker *TranscriberPool::acquire(TranscribePriority priority) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    const auto cls = (std::size_t) priority;
+    TranscriberClassStats &classStat = classStats[cls];
+
+    // every class has its own depth limit, a long batch backlog never turns away interactive requests.
+    // Queued jobs were admitted when they were submitted and do not count toward it.
+    if (pool.empty() && queues[cls].size() - backlog[cls] >= maxQueueDepth) {
+        rejectedQueueFull++;
+        classStat.rejected++;
+        throw TranscriberPoolBusyException("transcription queue is full", 429, retryAfterSecondsLocked());
+    }
+
+    return waitLocked(lock, priority, nullptr);
+}
+
+TranscribeWorker *TranscriberPool::acquireBacklog(TranscribePriority priority, const std::atomic<bool> &stop) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return waitLocked(lock, priority, &stop);
+}
+
+TranscribeWorker *TranscriberPool::waitLocked(std::unique_lock<std::mutex> &lock, TranscribePriority priority,
+                                              const std::atomic<bool> *stop) {
+    const auto cls = (std::size_t) priority;
+    TranscriberClassStats &classStat = classStats[cls];
+
+    auto start = std::chrono::steady_clock::now();
+    TranscribeWorker *worker = nullptr;
+
+    if (!pool.empty() && waiting == 0) {
+        worker = pool.top();
+        pool.pop();
+    } else {
+        // queued in its class until a released worker is handed to it
+        Waiter waiter;
+        waiter.since = start;
+        waiter.backlog = stop != nullptr;
+        queues[cls].push_back(&waiter);
+        waiting++;
+        auto served = [&waiter]() { return waiter.worker != nullptr; };
+        bool gotWorker;
+        if (waiter.backlog) {
+            // no deadline, only a look now and then whether the owner is shutting down
+            backlog[cls]++;
+            while (!(gotWorker = waiter.cv.wait_for(lock, std::chrono::seconds(1), served)) && !*stop) {
+            }
+        } else {
+            gotWorker = waiter.cv.wait_for(lock, maxQueueWait, served);
+        }
+
+        if (!gotWorker) {
+            queues[cls].erase(std::find(queues[cls].begin(), queues[cls].end(), &waiter));
+            waiting--;
+            if (waiter.backlog) {
+                backlog[cls]--;
+                return nullptr;
+            }
+            rejectedQueueTimeout++;
+            classStat.rejected++;
+            throw TranscriberPoolBusyException("timed out waiting for a transcription worker", 503,
+                                               retryAfterSecondsLocked());
+        }
+        worker = waiter.worker;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    double waitMs = std::chrono::duration<double, std::milli>(now - start).count();
+    waitMsTotal += waitMs;
+    waitMsMax = std::max(waitMsMax, waitMs);
+    acquired++;
+    classStat.wait_ms_total += waitMs;
+    classStat.wait_ms_max = std::max(classStat.wait_ms_max, waitMs);
+    classStat.acquired++;
+
+    leasedAt[worker] = now;
+    return worker;
+}
+
+void TranscriberPool::release(TranscribeWorker *worker) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto leased = leasedAt.find(worker);
+    if (leased != leasedAt.end()) {
+        double serviceMs = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - leased->second).count();
+        // exponentially weighted so the estimate follows the current traffic mix
+        serviceMsAverage = serviceMsAverage == 0 ? serviceMs : 0.8 * serviceMsAverage + 0.2 * serviceMs;
+        leasedAt.erase(leased);
+    }
+
+    handOffLocked(worker);
+}
+
+void TranscriberPool::handOffLocked(TranscribeWorker *worker) {
+    if (waiting == 0) {
+        pool.push(worker);
+        return;
+    }
+
+    const std::size_t cls = nextClassLocked();
+    Waiter *waiter = queues[cls].front();
+    queues[cls].pop_front();
+    waiting--;
+    if (waiter->backlog) {
+        backlog[cls]--;
+    }
+
+    waiter->worker = worker;
+    waiter->cv.notify_one();
+}
+
+std::size_t TranscriberPool::nextClassLocked() {
+    auto now = std::chrono::steady_clock::now();
+
+    // starvation protection: the longest waiter past the bound goes first, whatever the weights say
+    std::size_t oldest = TRANSCRIBE_PRIORITY_CLASSES;
+    for (std::size_t c = 0; c < TRANSCRIBE_PRIORITY_CLASSES; c++) {
+        if (!queues[c].empty() && now - queues[c].front()->since > maxStarvation &&
+            (oldest == TRANSCRIBE_PRIORITY_CLASSES || queues[c].front()->since < queues[oldest].front()->since)) {
+            oldest = c;
+        }
+    }
+    if (oldest != TRANSCRIBE_PRIORITY_CLASSES) {
+        return oldest;
+    }
+
+    // smooth weighted round robin: over any stretch of contention each class gets workers in
+    // proportion to its weight, interleaved instead of in bursts
+    int total = 0;
+    std::size_t chosen = TRANSCRIBE_PRIORITY_CLASSES;
+    for (std::size_t c = 0; c < TRANSCRIBE_PRIORITY_CLASSES; c++) {
+        if (queues[c].empty()) {
+            continue;
+        }
+        credits[c] += weights[c];
+        total += weights[c];
+        if (chosen == TRANSCRIBE_PRIORITY_CLASSES || credits[c] > credits[chosen]) {
+            chosen = c;
+        }
+    }
+    credits[chosen] -= total;
+    return chosen;
 }
 
-TranscribeWorker *TranscriberPool::acquire() {
+TranscribeWorker *TranscriberPool::tryAcquire() {
     std::unique_lock<std::mutex> lock(mutex);
 
-    // Wait until an item is available in the pool
-    while (pool.empty()) {
-        cv.wait(lock);
+    // only spare capacity, never ahead of requests already waiting for a worker
+    if (pool.empty() || waiting > 0) {
+        return nullptr;
     }
 
     TranscribeWorker *worker = pool.top();
     pool.pop();
+    leasedAt[worker] = std::chrono::steady_clock::now();
     return worker;
 }
 
-void TranscriberPool::release(TranscribeWorker *worker) {
+std::string TranscriberPool::transcribeSplit(WorkerLease &lease, TranscribeParams &params, const std::vector<float> &pcmf32,
+                                             const ChannelEnergy &channels, const OffsetMap *offsets) {
+
+    const auto minChunk = (std::size_t) std::max(0, params.split_min_chunk_sec) * COMMON_SAMPLE_RATE;
+    std::size_t maxChunks = minChunk == 0 ? 1 : std::max<std::size_t>(1, pcmf32.size() / minChunk);
+    if (params.split_max_chunks > 0) {
+        maxChunks = std::min(maxChunks, (std::size_t) params.split_max_chunks);
+    }
+    // a duration limit applies to the whole recording
+    if (params.duration_ms > 0) {
+        maxChunks = 1;
+    }
+
+    // reserved up front so no allocation can fail while helpers are held
+    std::vector<TranscribeWorker *> helpers;
+    helpers.reserve(maxChunks - 1);
+    while (helpers.size() + 1 < maxChunks) {
+        TranscribeWorker *helper = tryAcquire();
+        if (helper == nullptr) {
+            break;
+        }
+        helpers.push_back(helper);
+    }
+
+    if (helpers.empty()) {
+        return lease->Render(params, lease->TranscribeSegments(params, pcmf32.data(), pcmf32.size(), nullptr, offsets,
+                                                                   &channels));
+    }
+
+    const std::size_t chunks = helpers.size() + 1;
+    std::vector<std::size_t> bounds;
+    std::vector<TranscriptResult> results;
+    std::vector<std::exception_ptr> errors;
+    std::vector<std::thread> threads;
+    try {
+        // cut in the quietest stretch near each even split so no chunk starts or ends inside a word
+        bounds = VoiceActivityDetector::quietestCuts(pcmf32, chunks,
+                                                     std::min<std::size_t>(pcmf32.size() / chunks / 4,
+                                                                           10 * COMMON_SAMPLE_RATE));
+        bounds.insert(bounds.begin(), 0);
+        bounds.push_back(pcmf32.size());
+
+        results.resize(chunks);
+        errors.resize(chunks);
+        threads.reserve(helpers.size());
+        for (std::size_t i = 1; i < chunks; i++) {
+            threads.emplace_back([this, &params, &pcmf32, &bounds, &results, &errors, &helpers, i]() {
+                try {
+                    // the helper's lease takes its own cores and pins this thread to them
+                    WorkerLease helperLease(*this, helpers[i - 1]);
+                    TranscribeParams chunkParams = params;
+                    chunkParams.n_threads = helperLease.threads();
+                    results[i] = helperLease->TranscribeSegments(chunkParams, pcmf32.data() + bounds[i],
+                                                                 bounds[i + 1] - bounds[i]);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+    } catch (...) {
+        // helpers whose thread never started go back to the pool, the started ones release their own
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        for (std::size_t i = threads.size(); i < helpers.size(); i++) {
+            release(helpers[i]);
+        }
+        throw;
+    }
+
+    try {
+        results[0] = lease->TranscribeSegments(params, pcmf32.data(), bounds[1]);
+    } catch (...) {
+        errors[0] = std::current_exception();
+    }
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    for (auto &error: errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // chunk times are relative to the chunk, shift them onto the submitted audio before undoing the VAD
+    TranscriptResult merged;
+    merged.language = results[0].language;
+    for (std::size_t i = 0; i < chunks; i++) {
+        const auto shift = (int64_t) (bounds[i] * 100 / COMMON_SAMPLE_RATE);
+        for (auto &segment: results[i].segments) {
+            remapSegment(segment, [shift, offsets](int64_t t, bool end) {
+                return offsets && !offsets->empty() ? offsets->toOriginal(t + shift, end) : t + shift;
+            });
+            if (params.diarize && !channels.empty()) {
+                segment.speaker = channels.speaker(segment.t0, segment.t1);
+            }
+            merged.segments.push_back(std::move(segment));
+        }
+    }
+    return lease->Render(params, merged);
+}
+
+bool TranscriberPool::isSaturated(TranscribePriority priority) {
     std::unique_lock<std::mutex> lock(mutex);
-    pool.push(worker);
-    // Notify waiting threads that an item is available in the pool
-    cv.notify_one();
+    const auto cls = (std::size_t) priority;
+    return pool.empty() && queues[cls].size() - backlog[cls] >= maxQueueDepth;
 }
 
+void TranscriberPool::countRejected(TranscribePriority priority) {
+    std::unique_lock<std::mutex> lock(mutex);
+    rejectedQueueFull++;
+    classStats[(std::size_t) priority].rejected++;
+}
+
+TranscribePriority TranscriberPool::priorityOf(const TranscribeParams &params, TranscribePriority fallback) {
+    if (params.priority.empty()) {
+        return fallback;
+    }
+    TranscribePriority priority;
+    if (!priorityNamed(params.priority, priority)) {
+        throw TranscribeException("unknown priority " + params.priority);
+    }
+    return priority;
+}
+
+bool TranscriberPool::priorityNamed(const std::string &name, TranscribePriority &priority) {
+    for (std::size_t c = 0; c < TRANSCRIBE_PRIORITY_CLASSES; c++) {
+        if (name == priorityName((TranscribePriority) c)) {
+            priority = (TranscribePriority) c;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *TranscriberPool::priorityName(TranscribePriority priority) {
+    switch (priority) {
+        case TranscribePriority::Interactive:
+            return "interactive";
+        case TranscribePriority::Standard:
+            return "standard";
+        case TranscribePriority::Batch:
+            return "batch";
+    }
+    return "standard";
+}
+
+int TranscriberPool::retryAfterSeconds() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return retryAfterSecondsLocked();
+}
+
+int TranscriberPool::retryAfterSecondsLocked() const {
+    // every worker has to finish roughly (waiting / size + 1) jobs before a new request is served
+    double rounds = (double) waiting / (double) std::max<std::size_t>(1, size) + 1.0;
+    return std::max(1, (int) std::ceil(rounds * serviceMsAverage / 1000.0));
+}
+
+TranscriberPoolStats TranscriberPool::stats() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    TranscriberPoolStats stats;
+    stats.ready = isReady;
+    stats.size = size;
+    stats.idle = pool.size();
+    stats.waiting = waiting;
+    stats.max_queue_depth = maxQueueDepth;
+    stats.thread_budget = threadBudget->budget();
+    stats.threads_in_use = threadBudget->inUse();
+    stats.acquired = acquired;
+    stats.rejected_queue_full = rejectedQueueFull;
+    stats.rejected_queue_timeout = rejectedQueueTimeout;
+    stats.wait_ms_total = waitMsTotal;
+    stats.wait_ms_max = waitMsMax;
+    stats.service_ms_average = serviceMsAverage;
+    for (std::size_t c = 0; c < TRANSCRIBE_PRIORITY_CLASSES; c++) {
+        stats.classes[c] = classStats[c];
+        stats.classes[c].waiting = queues[c].size();
+    }
+    return stats;
+}
+
+WorkerLease::WorkerLease(TranscriberPool &pool, TranscribePriority priority)
+        : pool(pool),
+          start(std::chrono::steady_clock::now()),
+          worker(pool.acquire(priority)),
+          queueWaitMs(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()),
+          grant(pool.threads()) {
+}
+
+WorkerLease::WorkerLease(TranscriberPool &pool, TranscribeWorker *worker)
+        : pool(pool),
+          start(std::chrono::steady_clock::now()),
+          worker(worker),
+          queueWaitMs(0),
+          grant(pool.threads()) {
+}
+
+WorkerLease::~WorkerLease() {
+    pool.release(worker);
+}
@@ -8,22 +8,52 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <stack>
 #include <mutex>
+#include <unordered_map>
 #include <condition_variable>
+#include <functional>
+#include <memory>
 #include <thread>
 #include <utility>
 #include <vector>
 #include "utilities.h"
+#include "channel_energy.h"
+#include "thread_budget.h"
 #include "whisper.h"
 
 
+// Scheduling classes of TranscriberPool, a free worker goes to the class the weighted fair dequeue picks
+enum class TranscribePriority {
+    Interactive = 0,
+    Standard = 1,
+    Batch = 2
+};
+
+#define TRANSCRIBE_PRIORITY_CLASSES 3
+
+// Response body formats, see TranscriptFormats
+enum class OutputFormat {
+    Json,
+    MinimalJson,
+    NdJson,
+    Srt,
+    Vtt,
+    Binary
+};
+
 // processing parameters
 struct TranscribeParams {
+    // upper bound per request, the ThreadBudget decides how many threads a request actually gets
     int32_t n_threads = std::max(4, (int32_t) std::thread::hardware_concurrency());
+    // number of pooled workers, clamped to the thread budget
     int32_t n_processors = Utils::getEnvOrDefaultInt(ENV_NUMBER_OF_PROCESSORS,
-                                                     (int32_t) std::thread::hardware_concurrency());
-    int32_t offset_t_ms = Utils::getEnvOrDefaultInt(ENV_NUMBER_OF_PROCESSORS, 1);
+                                                     std::max(1, (int32_t) std::thread::hardware_concurrency() / 8));
+    // cut from the upload before VAD, see removeSilence
+    int32_t offset_t_ms = Utils::getEnvOrDefaultInt(ENV_OFFSET_TIME_MILISEC, 0);
     int32_t offset_n = Utils::getEnvOrDefaultInt(ENV_OFFSET_NUMBER, 0);
     int32_t duration_ms = Utils::getEnvOrDefaultInt(ENV_DURATION_MILISEC, 0);
     int32_t max_context = -Utils::getEnvOrDefaultInt(ENV_MAXIMUM_CONTEXT, -1);
@@ -41,6 +71,8 @@ struct TranscribeParams {
     bool diarize = Utils::getEnvOrDefaultBool(ENV_DIARIZE, false);
     bool tinydiarize = Utils::getEnvOrDefaultBool(ENV_TINY_DIARIZE, false);
     bool split_on_word = Utils::getEnvOrDefaultBool(ENV_SPLIT_ON_WORD, false);
+    // per-token times and probabilities in the response, whisper only computes token times when asked for
+    bool word_timestamps = Utils::getEnvOrDefaultBool(ENV_WORD_TIMESTAMPS, false);
     bool no_fallback = Utils::getEnvOrDefaultBool(ENV_NO_FALLBACK, false);
     bool no_timestamps = Utils::getEnvOrDefaultBool(ENV_NO_TIMESTAMPS, false);
 
@@ -48,42 +80,346 @@ struct TranscribeParams {
     std::string prompt = Utils::getEnvOrDefault(ENV_PROMPT, "");
     std::string language = Utils::getEnvOrDefault(ENV_DEFAULT_LANGUAGE, "en");
     std::string model = Utils::getEnvOrDefault(ENV_DEFAULT_MODEL, "/home/j/.cache/whisper/ggml-base.en.bin");
+    // name=path[@workers] entries separated by ';', empty serves only model, see ModelRegistry
+    std::string models = Utils::getEnvOrDefault(ENV_MODELS, "");
+    // conditions:name rules separated by ';', the first one matching a request picks its model
+    std::string model_routes = Utils::getEnvOrDefault(ENV_MODEL_ROUTES, "");
+    // registry name of the model a request asked for or was routed to, and the profile it picked
+    std::string model_name;
+    std::string profile = "default";
+    // upper bounds for what a request may ask for, see DecodeProfiles
+    int32_t max_beam_size = Utils::getEnvOrDefaultInt(ENV_MAX_BEAM_SIZE, 8);
+    int32_t max_best_of = Utils::getEnvOrDefaultInt(ENV_MAX_BEST_OF, 8);
+    int32_t max_prompt_length = Utils::getEnvOrDefaultInt(ENV_MAX_PROMPT_LENGTH, 1024);
 
+    // OpenVINO device for the encoder, empty runs it in ggml. Workers then load their own copy of the weights,
+    // this whisper.cpp revision only attaches OpenVINO to a context's default state.
+#ifdef TRANSCRIBER_OPENVINO
     std::string openvino_encode_device = Utils::getEnvOrDefault(ENV_OPEN_VINO_ENCODER, "CPU");
+#else
+    std::string openvino_encode_device = Utils::getEnvOrDefault(ENV_OPEN_VINO_ENCODER, "");
+#endif
+
+    // read the whole model file ahead while mapping it, and keep it locked in the page cache
+    bool model_prefetch = Utils::getEnvOrDefaultBool(ENV_MODEL_PREFETCH, true);
+    bool model_mlock = Utils::getEnvOrDefaultBool(ENV_MODEL_MLOCK, false);
+    // run one short inference on every worker before reporting ready
+    bool warmup = Utils::getEnvOrDefaultBool(ENV_WARMUP, true);
+
+    // cores shared by all workers, 0 uses every core the process may run on
+    int32_t thread_budget = Utils::getEnvOrDefaultInt(ENV_THREAD_BUDGET, 0);
+    bool thread_use_smt = Utils::getEnvOrDefaultBool(ENV_THREAD_USE_SMT, false);
+    bool thread_pinning = Utils::getEnvOrDefaultBool(ENV_THREAD_PINNING, true);
+
+    // interactive, standard or batch; empty leaves it to the endpoint, see TranscriberPool::priorityOf
+    std::string priority;
+    // share of freed workers each class gets while all of them are waiting
+    int32_t priority_weight_interactive = Utils::getEnvOrDefaultInt(ENV_PRIORITY_WEIGHT_INTERACTIVE, 8);
+    int32_t priority_weight_standard = Utils::getEnvOrDefaultInt(ENV_PRIORITY_WEIGHT_STANDARD, 4);
+    int32_t priority_weight_batch = Utils::getEnvOrDefaultInt(ENV_PRIORITY_WEIGHT_BATCH, 1);
+    // a request waiting longer than this is served next whatever its class
+    int32_t priority_max_wait_ms = Utils::getEnvOrDefaultInt(ENV_PRIORITY_MAX_WAIT_MILISEC, 5000);
+
+    // admission control: requests waiting for a worker beyond these limits are rejected
+    int32_t max_queue_depth = Utils::getEnvOrDefaultInt(ENV_MAX_QUEUE_DEPTH, n_processors);
+    int32_t max_queue_wait_ms = Utils::getEnvOrDefaultInt(ENV_MAX_QUEUE_WAIT_MILISEC, 30000);
+
+    // asynchronous jobs: pending limit, and how many finished results are kept for how long
+    int32_t max_pending_jobs = Utils::getEnvOrDefaultInt(ENV_MAX_PENDING_JOBS, 256);
+    int32_t job_retention_count = Utils::getEnvOrDefaultInt(ENV_JOB_RETENTION_COUNT, 1000);
+    int32_t job_retention_sec = Utils::getEnvOrDefaultInt(ENV_JOB_RETENTION_SEC, 3600);
+
+    // realtime sessions: decode every step, finalize windows at length, carry keep into the next window
+    int32_t realtime_step_ms = Utils::getEnvOrDefaultInt(ENV_REALTIME_STEP_MILISEC, 1000);
+    int32_t realtime_length_ms = Utils::getEnvOrDefaultInt(ENV_REALTIME_LENGTH_MILISEC, 10000);
+    int32_t realtime_keep_ms = Utils::getEnvOrDefaultInt(ENV_REALTIME_KEEP_MILISEC, 200);
+    int32_t realtime_idle_timeout_ms = Utils::getEnvOrDefaultInt(ENV_REALTIME_IDLE_TIMEOUT_MILISEC, 30000);
+    // each session holds a worker, keep some for file requests
+    int32_t max_realtime_sessions = Utils::getEnvOrDefaultInt(ENV_MAX_REALTIME_SESSIONS, std::max(1, n_processors / 2));
+
+    // drop long silences before inference, see VoiceActivityDetector
+    bool vad = Utils::getEnvOrDefaultBool(ENV_VAD, false);
+    float vad_threshold_db = Utils::getEnvOrDefaultFloat(ENV_VAD_THRESHOLD_DB, 10.0f);
+    int32_t vad_min_silence_ms = Utils::getEnvOrDefaultInt(ENV_VAD_MIN_SILENCE_MILISEC, 1000);
+    int32_t vad_padding_ms = Utils::getEnvOrDefaultInt(ENV_VAD_PADDING_MILISEC, 200);
+
+    // long recordings are split across idle workers into chunks of at least this many seconds, 0 disables it
+    int32_t split_min_chunk_sec = Utils::getEnvOrDefaultInt(ENV_SPLIT_MIN_CHUNK_SEC, 120);
+    // at most this many chunks per recording, 0 allows one per worker
+    int32_t split_max_chunks = Utils::getEnvOrDefaultInt(ENV_SPLIT_MAX_CHUNKS, 0);
+
+    // short clips wait up to this long for others to share an encoder window with, 0 disables batching
+    int32_t batch_max_delay_ms = Utils::getEnvOrDefaultInt(ENV_BATCH_MAX_DELAY_MILISEC, 0);
+    int32_t batch_max_clip_ms = Utils::getEnvOrDefaultInt(ENV_BATCH_MAX_CLIP_MILISEC, 8000);
+    // silence between two clips of a batch
+    int32_t batch_guard_ms = Utils::getEnvOrDefaultInt(ENV_BATCH_GUARD_MILISEC, 1000);
+
+    // finished results kept in memory up to this many megabytes, 0 disables the memory tier
+    int32_t cache_mb = Utils::getEnvOrDefaultInt(ENV_CACHE_MEGABYTES, 64);
+    // results also written here, empty disables the disk tier
+    std::string cache_dir = Utils::getEnvOrDefault(ENV_CACHE_DIR, "");
+    // least recently used files are deleted beyond this many megabytes, 0 leaves the directory to outside cleanup
+    int32_t cache_dir_mb = Utils::getEnvOrDefaultInt(ENV_CACHE_DIR_MEGABYTES, 1024);
+
+    // bodies smaller than this go out uncompressed, negative disables compression
+    int32_t compression_min_bytes = Utils::getEnvOrDefaultInt(ENV_COMPRESSION_MIN_BYTES, 1024);
+    // 0 uses the codec's default level, gzip 6 and zstd 3
+    int32_t compression_level = Utils::getEnvOrDefaultInt(ENV_COMPRESSION_LEVEL, 0);
+
+    // chosen per request from the query or the Accept header
+    OutputFormat output_format = OutputFormat::Json;
 
     std::vector<std::string> fname_inp = {};
     std::vector<std::string> fname_out = {};
 };
 
+class MappedModelFile;
+class OffsetMap;
+
+// One decoded token of a segment, special tokens are left out
+struct TranscriptWord {
+    int64_t t0 = 0;
+    int64_t t1 = 0;
+    float p = 0;
+    std::string text;
+};
+
+// One decoded segment, times in centiseconds like whisper reports them
+struct TranscriptSegment {
+    int64_t t0 = 0;
+    int64_t t1 = 0;
+    std::string text;
+    // only filled when TranscribeParams::word_timestamps is set
+    std::vector<TranscriptWord> words;
+    // channel that dominates the segment, see ChannelEnergy::speaker, empty without diarization
+    std::string speaker;
+};
+
+// Moves a segment and its words onto another timeline, map gets each time and whether it ends a span
+template<typename Map>
+void remapSegment(TranscriptSegment &segment, const Map &map) {
+    segment.t0 = map(segment.t0, false);
+    segment.t1 = map(segment.t1, true);
+    for (auto &word: segment.words) {
+        word.t0 = map(word.t0, false);
+        word.t1 = map(word.t1, true);
+    }
+}
+
+struct TranscriptResult {
+    std::string language;
+    std::vector<TranscriptSegment> segments;
+};
+
+// Receives every segment as soon as whisper finalizes it, returning false cancels the transcription
+typedef std::function<bool(const TranscriptSegment &segment)> SegmentCallback;
+
 class TranscribeWorker {
 public:
     TranscribeWorker();
 
     ~TranscribeWorker();
 
-    void Initialize(TranscribeParams &params);
+    // Creates this worker's whisper_state on top of weights owned by the pool
+    void Initialize(whisper_context *sharedContext);
 
-    std::string
-    Transcribe(TranscribeParams &params, std::vector<float> pcmf32, std::vector<std::vector<float>> &pcmf32s);
+    // Loads a context of its own with the encoder running on OpenVINO device
+    void InitializeOpenVino(const std::string &model, const std::string &device);
+
+    // Runs an inference on silence so the first request does not pay for page faults and allocations
+    void Warmup(int n_threads);
+
+    // Runs whisper on raw samples and collects the segments. offsets maps timestamps back to the original
+    // recording when silence was removed from the samples, channels labels speakers when params.diarize is set.
+    TranscriptResult
+    TranscribeSegments(TranscribeParams &params, const float *samples, std::size_t n_samples,
+                       const SegmentCallback &onSegment = nullptr, const OffsetMap *offsets = nullptr,
+                       const ChannelEnergy *channels = nullptr);
+
+    // Writes result in params.output_format
+    std::string Render(const TranscribeParams &params, const TranscriptResult &result);
+
+    // Decodes one window of a live stream as a single segment, conditioned on promptTokens.
+    // When keepTokens is set promptTokens is replaced by this window's tokens for the next one.
+    std::string TranscribeWindow(TranscribeParams &params, const std::vector<float> &window,
+                                 std::vector<whisper_token> &promptTokens, bool keepTokens);
 
 private:
-    whisper_context *context;
+    whisper_context *context = nullptr;
+    whisper_state *state = nullptr;
+    // true when context is this worker's own, state is then its default state
+    bool ownsContext = false;
+    // reservation for the next response, follows the recent ones up to OUTPUT_CAPACITY_MAX
+    std::size_t outputCapacity = 4096;
 };
 
+struct TranscriberClassStats {
+    std::size_t waiting = 0;
+    uint64_t acquired = 0;
+    uint64_t rejected = 0;
+    double wait_ms_total = 0;
+    double wait_ms_max = 0;
+};
+
+struct TranscriberPoolStats {
+    bool ready = false;
+    std::size_t size = 0;
+    std::size_t idle = 0;
+    std::size_t waiting = 0;
+    std::size_t max_queue_depth = 0;
+    int thread_budget = 0;
+    int threads_in_use = 0;
+    uint64_t acquired = 0;
+    uint64_t rejected_queue_full = 0;
+    uint64_t rejected_queue_timeout = 0;
+    double wait_ms_total = 0;
+    double wait_ms_max = 0;
+    double service_ms_average = 0;
+    TranscriberClassStats classes[TRANSCRIBE_PRIORITY_CLASSES];
+};
+
+class WorkerLease;
+
 class TranscriberPool {
 public:
+    // Returns immediately, the model is loaded and the workers are initialized and warmed in the background
     explicit TranscriberPool(std::size_t poolSize, TranscribeParams params);
 
+    // Shares the core budget with other pools, so several models never run more inferences than there are cores
+    TranscriberPool(std::size_t poolSize, TranscribeParams params, std::shared_ptr<ThreadBudget> budget);
+
     ~TranscriberPool();
 
-    TranscribeWorker *acquire();
+    // True once every worker is initialized and warm
+    bool ready();
+
+    // Blocks until start-up finished, throws TranscribeInitException when it failed
+    void waitUntilReady();
+
+    // Waits for an idle worker, throws TranscriberPoolBusyException when the queue of this class is full
+    // or the wait exceeds max_queue_wait_ms
+    TranscribeWorker *acquire(TranscribePriority priority = TranscribePriority::Standard);
+
+    // Waits for a worker outside the admission limits, for work accepted earlier such as queued jobs.
+    // It neither counts toward max_queue_depth nor times out, and returns nullptr once stop is set.
+    TranscribeWorker *acquireBacklog(TranscribePriority priority, const std::atomic<bool> &stop);
 
     void release(TranscribeWorker *worker);
 
+    // An idle worker when nobody is waiting for one, nullptr otherwise
+    TranscribeWorker *tryAcquire();
+
+    // Transcribes on the leased worker and, when the audio is long enough, on idle workers borrowed next to it.
+    // The audio is cut at quiet points and the chunk results are stitched back onto one timeline.
+    std::string transcribeSplit(WorkerLease &lease, TranscribeParams &params, const std::vector<float> &pcmf32,
+                                const ChannelEnergy &channels, const OffsetMap *offsets);
+
+    // Cheap pre-check so a request can be turned away before its upload is read, counts nothing
+    bool isSaturated(TranscribePriority priority = TranscribePriority::Standard);
+
+    // Records a request turned away because isSaturated held
+    void countRejected(TranscribePriority priority);
+
+    // The class params asks for, or fallback when it names none. Throws TranscribeException for unknown names.
+    static TranscribePriority priorityOf(const TranscribeParams &params, TranscribePriority fallback);
+
+    // False when name is not one of interactive, standard and batch
+    static bool priorityNamed(const std::string &name, TranscribePriority &priority);
+
+    static const char *priorityName(TranscribePriority priority);
+
+    // Seconds a rejected client should wait, estimated from queue depth and recent service times
+    int retryAfterSeconds();
+
+    TranscriberPoolStats stats();
+
+    ThreadBudget &threads() { return *threadBudget; }
+
 private:
+    // A request queued for a worker, the releasing thread hands the worker over directly
+    struct Waiter {
+        std::condition_variable cv;
+        std::chrono::steady_clock::time_point since;
+        TranscribeWorker *worker = nullptr;
+        bool backlog = false;
+    };
+
+    void start(TranscribeParams params);
+
+    // Queues for a worker unless one is idle, stop is null for requests under the admission limits
+    TranscribeWorker *waitLocked(std::unique_lock<std::mutex> &lock, TranscribePriority priority,
+                                 const std::atomic<bool> *stop);
+
+    // Gives a free worker to the next waiter, or back to the idle workers when nobody waits
+    void handOffLocked(TranscribeWorker *worker);
+
+    // Smooth weighted round robin over the classes with waiters, a waiter past the starvation bound goes first
+    std::size_t nextClassLocked();
+
+    int retryAfterSecondsLocked() const;
+
+    std::shared_ptr<ThreadBudget> threadBudget;
+    std::size_t size;
+    std::unique_ptr<MappedModelFile> modelFile;
+    whisper_context *context = nullptr;
+    std::size_t maxQueueDepth;
+    std::chrono::milliseconds maxQueueWait;
+
     std::stack<TranscribeWorker *> pool;
+    std::unordered_map<TranscribeWorker *, std::chrono::steady_clock::time_point> leasedAt;
     std::mutex mutex;
-    std::condition_variable cv;
+
+    std::deque<Waiter *> queues[TRANSCRIBE_PRIORITY_CLASSES];
+    // waiters of each queue that came through acquireBacklog
+    std::size_t backlog[TRANSCRIBE_PRIORITY_CLASSES] = {0, 0, 0};
+    int weights[TRANSCRIBE_PRIORITY_CLASSES];
+    int credits[TRANSCRIBE_PRIORITY_CLASSES] = {0, 0, 0};
+    std::chrono::milliseconds maxStarvation;
+    TranscriberClassStats classStats[TRANSCRIBE_PRIORITY_CLASSES];
+
+    std::thread startup;
+    std::condition_variable startupCv;
+    bool isReady = false;
+    bool startupFailed = false;
+    std::string startupError;
+
+    std::size_t waiting = 0;
+    uint64_t acquired = 0;
+    uint64_t rejectedQueueFull = 0;
+    uint64_t rejectedQueueTimeout = 0;
+    double waitMsTotal = 0;
+    double waitMsMax = 0;
+    double serviceMsAverage = 0;
+};
+
+// Holds a worker for the lifetime of the scope so it goes back to the pool even when Transcribe throws
+class WorkerLease {
+public:
+    explicit WorkerLease(TranscriberPool &pool, TranscribePriority priority = TranscribePriority::Standard);
+
+    // Adopts a worker already taken from the pool with tryAcquire or acquireBacklog
+    WorkerLease(TranscriberPool &pool, TranscribeWorker *worker);
+
+    ~WorkerLease();
+
+    WorkerLease(const WorkerLease &) = delete;
+
+    WorkerLease &operator=(const WorkerLease &) = delete;
+
+    TranscribeWorker *operator->() const { return worker; }
+
+    // Time spent queued before the worker was handed out
+    [[nodiscard]] double waitMs() const { return queueWaitMs; }
+
+    // Threads this request may run, already pinned to its cores
+    [[nodiscard]] int threads() const { return grant.threads(); }
+
+private:
+    TranscriberPool &pool;
+    std::chrono::steady_clock::time_point start;
+    TranscribeWorker *worker;
+    double queueWaitMs;
+    ThreadGrant grant;
 };
 
 class TranscribeInitException : public std::exception {
@@ -98,6 +434,26 @@ private:
     std::string msg;
 };
 
+class TranscriberPoolBusyException : public std::exception {
+public:
+    TranscriberPoolBusyException(std::string message, int status, int retryAfterSeconds)
+            : msg(std::move(message)), httpStatus(status), retryAfter(retryAfterSeconds) {}
+
+    [[nodiscard]] const char *what() const noexcept override {
+        return msg.c_str();
+    }
+
+    // 429 when the queue is full, 503 when the wait for a worker timed out
+    [[nodiscard]] int status() const noexcept { return httpStatus; }
+
+    [[nodiscard]] int retryAfterSeconds() const noexcept { return retryAfter; }
+
+private:
+    std::string msg;
+    int httpStatus;
+    int retryAfter;
+};
+
 class TranscribeException : public std::exception {
 public:
     explicit TranscribeException(std::string message) : msg(std::move(message)) {}
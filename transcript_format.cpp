@@ -0,0 +1,212 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "transcript_format.h"
+
+#include <algorithm>
+#include <charconv>
+
+
+namespace {
+
+    void appendVarint(std::string &out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back((char) ((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.push_back((char) value);
+    }
+
+    void appendNumber(std::string &out, uint64_t value) {
+        char digits[24];
+        auto written = std::to_chars(digits, digits + sizeof(digits), value);
+        out.append(digits, written.ptr);
+    }
+
+    // Cue text on one line. WebVTT needs &, < and > escaped, SRT has no escapes but a --> in the text or a
+    // blank line would end the cue for most parsers. Text that would be empty gets a placeholder instead.
+    void appendCueText(std::string &out, const std::string &text, bool webVtt) {
+        // whisper starts words with a space, a cue line should not
+        const std::size_t begin = std::min(text.find_first_not_of(' '), text.size());
+        const std::size_t before = out.size();
+        for (std::size_t i = begin; i < text.size(); i++) {
+            const char c = text[i];
+            if (c == '\n' || c == '\r') {
+                out.push_back(' ');
+            } else if (webVtt && c == '&') {
+                out.append("&amp;");
+            } else if (webVtt && c == '<') {
+                out.append("&lt;");
+            } else if (webVtt && c == '>') {
+                out.append("&gt;");
+            } else if (!webVtt && c == '>' && out.size() - before >= 2 && out.compare(out.size() - 2, 2, "--") == 0) {
+                // --> becomes ->
+                out.pop_back();
+                out.push_back('>');
+            } else {
+                out.push_back(c);
+            }
+        }
+        if (out.find_first_not_of(' ', before) == std::string::npos) {
+            out.resize(before);
+            out.append("...");
+        }
+    }
+
+    void writeSegment(JsonWriter &writer, const TranscriptSegment &segment) {
+        writer.beginObject()
+                .number("from", segment.t0 * 10)
+                .number("to", segment.t1 * 10)
+                .string("text", segment.text);
+        TranscriptFormats::annotations(writer, segment);
+        writer.endObject();
+    }
+
+}
+
+bool TranscriptFormats::named(const std::string &name, OutputFormat &format) {
+    static const OutputFormat formats[] = {OutputFormat::Json, OutputFormat::MinimalJson, OutputFormat::NdJson,
+                                           OutputFormat::Srt, OutputFormat::Vtt, OutputFormat::Binary};
+    for (OutputFormat candidate: formats) {
+        if (name == TranscriptFormats::name(candidate)) {
+            format = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *TranscriptFormats::name(OutputFormat format) {
+    switch (format) {
+        case OutputFormat::Json:
+            return "json";
+        case OutputFormat::MinimalJson:
+            return "json-min";
+        case OutputFormat::NdJson:
+            return "ndjson";
+        case OutputFormat::Srt:
+            return "srt";
+        case OutputFormat::Vtt:
+            return "vtt";
+        case OutputFormat::Binary:
+            return "binary";
+    }
+    return "json";
+}
+
+const char *TranscriptFormats::contentType(OutputFormat format) {
+    switch (format) {
+        case OutputFormat::Json:
+            return "text/json";
+        case OutputFormat::MinimalJson:
+            return "application/json";
+        case OutputFormat::NdJson:
+            return "application/x-ndjson";
+        case OutputFormat::Srt:
+            return "application/x-subrip";
+        case OutputFormat::Vtt:
+            return "text/vtt";
+        case OutputFormat::Binary:
+            return "application/x-transcript-segments";
+    }
+    return "text/json";
+}
+
+void TranscriptFormats::render(std::string &out, OutputFormat format, const TranscriptResult &result) {
+    switch (format) {
+        case OutputFormat::MinimalJson:
+            minimalJson(out, result);
+            break;
+        case OutputFormat::NdJson:
+            ndJson(out, result);
+            break;
+        case OutputFormat::Srt:
+            subtitles(out, result, false);
+            break;
+        case OutputFormat::Vtt:
+            subtitles(out, result, true);
+            break;
+        case OutputFormat::Binary:
+            binary(out, result);
+            break;
+        case OutputFormat::Json:
+            break;
+    }
+}
+
+void TranscriptFormats::annotations(JsonWriter &writer, const TranscriptSegment &segment) {
+    if (!segment.speaker.empty()) {
+        writer.string("speaker", segment.speaker);
+    }
+    if (segment.words.empty()) {
+        return;
+    }
+    writer.beginArray("words");
+    for (const auto &word: segment.words) {
+        writer.beginObject()
+                .string("text", word.text)
+                .number("from", word.t0 * 10)
+                .number("to", word.t1 * 10)
+                .decimal("p", word.p)
+                .endObject();
+    }
+    writer.endArray();
+}
+
+void TranscriptFormats::subtitles(std::string &out, const TranscriptResult &result, bool webVtt) {
+    if (webVtt) {
+        out.append("WEBVTT\n\n");
+    }
+    for (std::size_t i = 0; i < result.segments.size(); i++) {
+        const TranscriptSegment &segment = result.segments[i];
+        // cue numbers are required by SRT and optional in WebVTT
+        if (!webVtt) {
+            appendNumber(out, i + 1);
+            out.push_back('\n');
+        }
+        JsonWriter::appendTimestamp(out, segment.t0, !webVtt);
+        out.append(" --> ");
+        JsonWriter::appendTimestamp(out, segment.t1, !webVtt);
+        out.push_back('\n');
+        // WebVTT has voice spans for speakers, SRT only the text
+        if (!segment.speaker.empty()) {
+            out.append(webVtt ? "<v Speaker " : "(speaker ");
+            out.append(segment.speaker);
+            out.append(webVtt ? ">" : ") ");
+        }
+        appendCueText(out, segment.text, webVtt);
+        out.append("\n\n");
+    }
+}
+
+void TranscriptFormats::minimalJson(std::string &out, const TranscriptResult &result) {
+    JsonWriter writer(out, false);
+    writer.beginObject()
+            .string("language", result.language)
+            .beginArray("segments");
+    for (const auto &segment: result.segments) {
+        writeSegment(writer, segment);
+    }
+    writer.endArray().endObject();
+}
+
+void TranscriptFormats::ndJson(std::string &out, const TranscriptResult &result) {
+    for (const auto &segment: result.segments) {
+        JsonWriter writer(out, false);
+        writeSegment(writer, segment);
+        out.push_back('\n');
+    }
+}
+
+void TranscriptFormats::binary(std::string &out, const TranscriptResult &result) {
+    appendVarint(out, result.language.size());
+    out.append(result.language);
+    appendVarint(out, result.segments.size());
+    for (const auto &segment: result.segments) {
+        appendVarint(out, (uint64_t) std::max<int64_t>(0, segment.t0) * 10);
+        appendVarint(out, (uint64_t) std::max<int64_t>(0, segment.t1) * 10);
+        appendVarint(out, segment.text.size());
+        out.append(segment.text);
+    }
+}
@@ -0,0 +1,46 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_TRANSCRIPT_FORMAT_H
+#define TRANSCRIBER_TRANSCRIPT_FORMAT_H
+
+#include <string>
+#include "transcriber.h"
+#include "json_writer.h"
+
+
+// Renderers for the compact response formats, each writing the segments straight into one buffer.
+// The full JSON document also describes the model and is rendered by the worker that owns it.
+//
+// The binary format is a sequence of unsigned LEB128 varints and raw bytes:
+//   language length, language bytes, segment count,
+//   then per segment: start ms, end ms, text length, UTF-8 text bytes
+class TranscriptFormats {
+public:
+    // json, json-min, ndjson, srt, vtt or binary
+    static bool named(const std::string &name, OutputFormat &format);
+
+    static const char *name(OutputFormat format);
+
+    static const char *contentType(OutputFormat format);
+
+    // Appends result to out in format, which must not be OutputFormat::Json
+    static void render(std::string &out, OutputFormat format, const TranscriptResult &result);
+
+    // The optional members of a segment object: "speaker" when diarized, and a "words" array of its
+    // tokens with times in ms and probabilities. The binary format carries segments only.
+    static void annotations(JsonWriter &writer, const TranscriptSegment &segment);
+
+private:
+    static void subtitles(std::string &out, const TranscriptResult &result, bool webVtt);
+
+    static void minimalJson(std::string &out, const TranscriptResult &result);
+
+    static void ndJson(std::string &out, const TranscriptResult &result);
+
+    static void binary(std::string &out, const TranscriptResult &result);
+};
+
+
+#endif //TRANSCRIBER_TRANSCRIPT_FORMAT_H
@@ -26,14 +26,53 @@ const static char *ENV_TRANSLATE = "ENV_TRANSLATE";
 const static char *ENV_DIARIZE = "ENV_DIARIZE";
 const static char *ENV_TINY_DIARIZE = "ENV_TINY_DIARIZE";
 const static char *ENV_SPLIT_ON_WORD = "ENV_SPLIT_ON_WORD";
+const static char *ENV_WORD_TIMESTAMPS = "ENV_WORD_TIMESTAMPS";
 const static char *ENV_DEFAULT_LANGUAGE = "ENV_DEFAULT_LANGUAGE";
 const static char *ENV_DETECT_LANGUAGE = "ENV_DETECT_LANGUAGE";
 const static char *ENV_NO_FALLBACK = "ENV_NO_FALLBACK";
 const static char *ENV_NO_TIMESTAMPS = "ENV_NO_TIMESTAMPS";
 const static char *ENV_PROMPT = "ENV_PROMPT";
 const static char *ENV_DEFAULT_MODEL = "ENV_DEFAULT_MODEL";
+const static char *ENV_MODELS = "ENV_MODELS";
+const static char *ENV_MODEL_ROUTES = "ENV_MODEL_ROUTES";
 const static char *ENV_OPEN_VINO_ENCODER = "ENV_OPEN_VINO_ENCODER";
-const static char *ENV_PATH_FOR_AUDIO_FILES = "ENV_PATH_FOR_AUDIO_FILES";
+const static char *ENV_MODEL_PREFETCH = "ENV_MODEL_PREFETCH";
+const static char *ENV_MODEL_MLOCK = "ENV_MODEL_MLOCK";
+const static char *ENV_WARMUP = "ENV_WARMUP";
+const static char *ENV_MAX_PENDING_JOBS = "ENV_MAX_PENDING_JOBS";
+const static char *ENV_JOB_RETENTION_COUNT = "ENV_JOB_RETENTION_COUNT";
+const static char *ENV_JOB_RETENTION_SEC = "ENV_JOB_RETENTION_SEC";
+const static char *ENV_REALTIME_STEP_MILISEC = "ENV_REALTIME_STEP_MILISEC";
+const static char *ENV_REALTIME_LENGTH_MILISEC = "ENV_REALTIME_LENGTH_MILISEC";
+const static char *ENV_REALTIME_KEEP_MILISEC = "ENV_REALTIME_KEEP_MILISEC";
+const static char *ENV_REALTIME_IDLE_TIMEOUT_MILISEC = "ENV_REALTIME_IDLE_TIMEOUT_MILISEC";
+const static char *ENV_MAX_REALTIME_SESSIONS = "ENV_MAX_REALTIME_SESSIONS";
+const static char *ENV_VAD = "ENV_VAD";
+const static char *ENV_VAD_THRESHOLD_DB = "ENV_VAD_THRESHOLD_DB";
+const static char *ENV_VAD_MIN_SILENCE_MILISEC = "ENV_VAD_MIN_SILENCE_MILISEC";
+const static char *ENV_VAD_PADDING_MILISEC = "ENV_VAD_PADDING_MILISEC";
+const static char *ENV_SPLIT_MIN_CHUNK_SEC = "ENV_SPLIT_MIN_CHUNK_SEC";
+const static char *ENV_SPLIT_MAX_CHUNKS = "ENV_SPLIT_MAX_CHUNKS";
+const static char *ENV_BATCH_MAX_DELAY_MILISEC = "ENV_BATCH_MAX_DELAY_MILISEC";
+const static char *ENV_BATCH_MAX_CLIP_MILISEC = "ENV_BATCH_MAX_CLIP_MILISEC";
+const static char *ENV_BATCH_GUARD_MILISEC = "ENV_BATCH_GUARD_MILISEC";
+const static char *ENV_CACHE_MEGABYTES = "ENV_CACHE_MEGABYTES";
+const static char *ENV_CACHE_DIR = "ENV_CACHE_DIR";
+const static char *ENV_CACHE_DIR_MEGABYTES = "ENV_CACHE_DIR_MEGABYTES";
+const static char *ENV_COMPRESSION_MIN_BYTES = "ENV_COMPRESSION_MIN_BYTES";
+const static char *ENV_COMPRESSION_LEVEL = "ENV_COMPRESSION_LEVEL";
+const static char *ENV_MAX_BEAM_SIZE = "ENV_MAX_BEAM_SIZE";
+const static char *ENV_MAX_BEST_OF = "ENV_MAX_BEST_OF";
+const static char *ENV_MAX_PROMPT_LENGTH = "ENV_MAX_PROMPT_LENGTH";
+const static char *ENV_THREAD_BUDGET = "ENV_THREAD_BUDGET";
+const static char *ENV_THREAD_USE_SMT = "ENV_THREAD_USE_SMT";
+const static char *ENV_THREAD_PINNING = "ENV_THREAD_PINNING";
+const static char *ENV_PRIORITY_WEIGHT_INTERACTIVE = "ENV_PRIORITY_WEIGHT_INTERACTIVE";
+const static char *ENV_PRIORITY_WEIGHT_STANDARD = "ENV_PRIORITY_WEIGHT_STANDARD";
+const static char *ENV_PRIORITY_WEIGHT_BATCH = "ENV_PRIORITY_WEIGHT_BATCH";
+const static char *ENV_PRIORITY_MAX_WAIT_MILISEC = "ENV_PRIORITY_MAX_WAIT_MILISEC";
+const static char *ENV_MAX_QUEUE_DEPTH = "ENV_MAX_QUEUE_DEPTH";
+const static char *ENV_MAX_QUEUE_WAIT_MILISEC = "ENV_MAX_QUEUE_WAIT_MILISEC";
 
 
 class Utils {
@@ -44,10 +83,20 @@ public:
         return env_var_value ? std::string(env_var_value) : default_value;
     }
 
+    // true/1/yes/on and false/0/no/off, the default when unset or anything else
     static int getEnvOrDefaultBool(const char *env_var_name, bool default_value) {
 
-        std::string env = getEnvOrDefault(env_var_name, std::to_string(default_value));
-        return env == "true" || env == "1" || env == "yes" || env == "on" || default_value;
+        std::string env = getEnvOrDefault(env_var_name, "");
+        if (env == "true" || env == "1" || env == "yes" || env == "on") {
+            return true;
+        }
+        if (env == "false" || env == "0" || env == "no" || env == "off") {
+            return false;
+        }
+        if (!env.empty()) {
+            std::cerr << "Error converting string to boolean: " << env_var_name << "=" << env << std::endl;
+        }
+        return default_value;
 
     }
 
@@ -73,12 +122,6 @@ public:
         }
     }
 
-    static std::string getFilesStoragePath( std::string fileName ){
-
-        std::string fileDirectory = getEnvOrDefault(ENV_PATH_FOR_AUDIO_FILES, "/tmp/");
-                return fileDirectory.append(fileName);
-    }
-
     static void logStackTrace() {
         const int max_frames = 50;
         void* frames[max_frames];
@@ -0,0 +1,183 @@
+//
+// Created by j on 18/10/26.
+//
+
+#include "vad.h"
+#include "audio_kernels.h"
+#include "audio_tooling.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#define VAD_FRAME_SAMPLES (COMMON_SAMPLE_RATE / 100)
+// keeps threshold from landing inside speech when the recording has no pauses
+#define VAD_MAX_BELOW_LOUD_DB 25.0f
+// frames a cut point has to be quiet for
+#define VAD_CUT_FRAMES 30
+
+
+void OffsetMap::add(std::size_t compactedStart, std::size_t originalStart, std::size_t length) {
+    pieces.push_back({compactedStart, originalStart, length});
+}
+
+void OffsetMap::shift(std::size_t samples, std::size_t length) {
+    if (samples == 0) {
+        return;
+    }
+    if (pieces.empty()) {
+        add(0, samples, length);
+        return;
+    }
+    for (auto &piece: pieces) {
+        piece.originalStart += samples;
+    }
+}
+
+int64_t OffsetMap::toOriginal(int64_t t, bool end) const {
+    if (pieces.empty()) {
+        return t;
+    }
+
+    const auto sample = (std::size_t) std::max<int64_t>(0, t) * COMMON_SAMPLE_RATE / 100;
+
+    // last piece starting before (end) or at (start) the sample
+    auto next = std::upper_bound(pieces.begin(), pieces.end(), sample, [end](std::size_t s, const Piece &piece) {
+        return end ? s <= piece.compactedStart : s < piece.compactedStart;
+    });
+    const Piece &piece = next == pieces.begin() ? pieces.front() : *(next - 1);
+
+    std::size_t into = std::min(sample - std::min(sample, piece.compactedStart), piece.length);
+    return (int64_t) ((piece.originalStart + into) * 100 / COMMON_SAMPLE_RATE);
+}
+
+std::vector<SpeechRegion> VoiceActivityDetector::detect(const std::vector<float> &pcmf32, const VadParams &params) {
+    const std::size_t frames = pcmf32.size() / VAD_FRAME_SAMPLES;
+    if (frames == 0) {
+        return {};
+    }
+
+    std::vector<float> energy(frames);
+    for (std::size_t i = 0; i < frames; i++) {
+        const float *frame = pcmf32.data() + i * VAD_FRAME_SAMPLES;
+        float power = AudioKernels::dot(frame, frame, VAD_FRAME_SAMPLES) / VAD_FRAME_SAMPLES;
+        energy[i] = 10.0f * std::log10(power + 1e-10f);
+    }
+
+    std::vector<float> sorted = energy;
+    std::nth_element(sorted.begin(), sorted.begin() + (long) (frames / 10), sorted.end());
+    const float noiseFloor = sorted[frames / 10];
+    std::nth_element(sorted.begin(), sorted.begin() + (long) (frames * 95 / 100), sorted.end());
+    const float loud = sorted[frames * 95 / 100];
+
+    const float threshold = std::min(noiseFloor + params.threshold_db, loud - VAD_MAX_BELOW_LOUD_DB);
+
+    const auto padding = (std::size_t) std::max(0, params.padding_ms) / 10;
+    const auto minSilence = (std::size_t) std::max(0, params.min_silence_ms) / 10;
+
+    // speech frames grown by the padding, merged whenever the silence between them is too short to drop
+    std::vector<SpeechRegion> regions;
+    for (std::size_t i = 0; i < frames; i++) {
+        if (energy[i] <= threshold) {
+            continue;
+        }
+        std::size_t start = i > padding ? i - padding : 0;
+        std::size_t end = std::min(frames, i + 1 + padding);
+        if (!regions.empty() && start <= regions.back().end + minSilence) {
+            regions.back().end = std::max(regions.back().end, end);
+        } else {
+            regions.push_back({start, end});
+        }
+    }
+
+    for (auto &region: regions) {
+        region.start *= VAD_FRAME_SAMPLES;
+        region.end *= VAD_FRAME_SAMPLES;
+    }
+    // the tail shorter than a frame belongs to the last region if that one reaches the end
+    if (!regions.empty() && regions.back().end == frames * VAD_FRAME_SAMPLES) {
+        regions.back().end = pcmf32.size();
+    }
+    return regions;
+}
+
+std::vector<std::size_t> VoiceActivityDetector::quietestCuts(const std::vector<float> &pcmf32, std::size_t parts,
+                                                             std::size_t search) {
+    std::vector<std::size_t> cuts;
+    const std::size_t frames = pcmf32.size() / VAD_FRAME_SAMPLES;
+    if (parts < 2 || frames < parts * VAD_CUT_FRAMES) {
+        for (std::size_t k = 1; k < parts; k++) {
+            cuts.push_back(pcmf32.size() * k / parts);
+        }
+        return cuts;
+    }
+
+    std::vector<float> power(frames);
+    for (std::size_t i = 0; i < frames; i++) {
+        const float *frame = pcmf32.data() + i * VAD_FRAME_SAMPLES;
+        power[i] = AudioKernels::dot(frame, frame, VAD_FRAME_SAMPLES);
+    }
+
+    // prefix sums turn the energy of any run of frames into one subtraction
+    std::vector<double> prefix(frames + 1, 0.0);
+    for (std::size_t i = 0; i < frames; i++) {
+        prefix[i + 1] = prefix[i] + power[i];
+    }
+
+    const std::size_t searchFrames = search / VAD_FRAME_SAMPLES;
+    std::size_t previous = 0;
+    for (std::size_t k = 1; k < parts; k++) {
+        const std::size_t target = frames * k / parts;
+        const std::size_t from = std::max(previous + 1, target > searchFrames ? target - searchFrames : 0);
+        const std::size_t to = std::min(frames - VAD_CUT_FRAMES, target + searchFrames);
+
+        std::size_t best = std::min(std::max(target, from), to);
+        double bestEnergy = prefix[best + VAD_CUT_FRAMES] - prefix[best];
+        for (std::size_t i = from; i <= to; i++) {
+            double energy = prefix[i + VAD_CUT_FRAMES] - prefix[i];
+            if (energy < bestEnergy) {
+                bestEnergy = energy;
+                best = i;
+            }
+        }
+
+        // middle of the quiet stretch
+        previous = best + VAD_CUT_FRAMES / 2;
+        cuts.push_back(previous * VAD_FRAME_SAMPLES);
+    }
+    return cuts;
+}
+
+VadResult VoiceActivityDetector::compact(std::vector<float> &pcmf32, const VadParams &params) {
+    auto start = std::chrono::steady_clock::now();
+
+    VadResult result;
+    result.inputSamples = pcmf32.size();
+    result.keptSamples = pcmf32.size();
+
+    std::vector<SpeechRegion> regions = detect(pcmf32, params);
+
+    std::size_t kept = 0;
+    for (const auto &region: regions) {
+        kept += region.end - region.start;
+    }
+
+    if (!regions.empty() && kept < pcmf32.size()) {
+        std::size_t write = 0;
+        for (const auto &region: regions) {
+            const std::size_t length = region.end - region.start;
+            result.offsets.add(write, region.start, length);
+            if (write != region.start) {
+                memmove(pcmf32.data() + write, pcmf32.data() + region.start, length * sizeof(float));
+            }
+            write += length;
+        }
+
+        pcmf32.resize(write);
+        result.keptSamples = write;
+    }
+
+    result.durationMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
@@ -0,0 +1,81 @@
+//
+// Created by j on 18/10/26.
+//
+
+#ifndef TRANSCRIBER_VAD_H
+#define TRANSCRIBER_VAD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+// Half-open range of samples
+struct SpeechRegion {
+    std::size_t start;
+    std::size_t end;
+};
+
+// Maps positions in compacted audio back to the original recording. Empty means identity.
+class OffsetMap {
+public:
+    void add(std::size_t compactedStart, std::size_t originalStart, std::size_t length);
+
+    [[nodiscard]] bool empty() const { return pieces.empty(); }
+
+    // Moves the original timeline samples later, for audio whose first samples were cut before it was
+    // compacted. length is the size of the audio that is left, the identity map becomes one piece of it.
+    void shift(std::size_t samples, std::size_t length);
+
+    // Whisper times (centiseconds) on the compacted timeline to the original one. An end time that falls
+    // on the boundary between two kept pieces stays at the end of the earlier piece.
+    [[nodiscard]] int64_t toOriginal(int64_t t, bool end = false) const;
+
+private:
+    struct Piece {
+        std::size_t compactedStart;
+        std::size_t originalStart;
+        std::size_t length;
+    };
+
+    std::vector<Piece> pieces;
+};
+
+struct VadParams {
+    // speech is louder than the noise floor by this many dB
+    float threshold_db = 10.0f;
+    // only silences at least this long are removed
+    int32_t min_silence_ms = 1000;
+    // audio kept around every speech region
+    int32_t padding_ms = 200;
+};
+
+struct VadResult {
+    OffsetMap offsets;
+    std::size_t inputSamples = 0;
+    std::size_t keptSamples = 0;
+    double durationMs = 0;
+
+    [[nodiscard]] double skippedRatio() const {
+        return inputSamples == 0 ? 0.0 : 1.0 - (double) keptSamples / (double) inputSamples;
+    }
+};
+
+// Energy based voice activity detection on 10 ms frames. The threshold adapts to the recording: it sits
+// threshold_db above the noise floor (10th percentile frame energy), but never closer than 25 dB below the
+// loud frames (95th percentile), so recordings without pauses are not mistaken for noise.
+class VoiceActivityDetector {
+public:
+    static std::vector<SpeechRegion> detect(const std::vector<float> &pcmf32, const VadParams &params);
+
+    // parts - 1 cut positions, each at the quietest 300 ms within search samples of an even split
+    static std::vector<std::size_t> quietestCuts(const std::vector<float> &pcmf32, std::size_t parts,
+                                                 std::size_t search);
+
+    // Removes long silences in place, returns how to map whisper's timestamps back. Audio without any
+    // detected speech is left untouched.
+    static VadResult compact(std::vector<float> &pcmf32, const VadParams &params);
+};
+
+
+#endif //TRANSCRIBER_VAD_H